@@ -0,0 +1,241 @@
+//========================================================//
+//  attrib.c                                              //
+//  Source file for the miss attribution of the           //
+//  Cache Simulator                                       //
+//                                                        //
+//  Misses are bucketed by cache level and address        //
+//  region in an open-addressing hash table, and the      //
+//  regions with the most misses are reported at the end  //
+//========================================================//
+
+#define _GNU_SOURCE
+#include "attrib.h"
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+
+//------------------------------------//
+//      Attribution Configuration     //
+//------------------------------------//
+
+__thread uint32_t attributeRegion;  // Size of an address region in bytes
+__thread uint32_t attributeTopK;    // Number of regions to report per cache
+__thread int      attributeMisses;  // Indicates if misses are being attributed
+
+//------------------------------------//
+//     Attribution Data Structures    //
+//------------------------------------//
+
+// A named range of addresses from the region map
+struct range {
+  uint64_t start;
+  uint64_t end;    // One past the last address of the range
+  char *name;
+};
+
+struct range *ranges = NULL;
+int numRanges = 0;
+
+// Regions are keyed by their number, whether it is a range of the map or an
+// aligned block of attributeRegion bytes, and the cache level. A key of 0
+// marks an empty slot, so keys are stored off by one
+//
+#define KEY_MAPPED 4
+
+struct bucket {
+  uint64_t key;
+  uint64_t misses;
+  uint64_t penalties;
+};
+
+struct bucket *buckets = NULL;
+uint32_t numBuckets;      // Always a power of two
+uint32_t usedBuckets;
+int regionBits;
+
+//------------------------------------//
+//          Helper Functions          //
+//------------------------------------//
+
+int
+compare_ranges(const void *a, const void *b) {
+  const struct range *ra = a, *rb = b;
+  return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+int
+compare_buckets(const void *a, const void *b) {
+  const struct bucket *ba = a, *bb = b;
+  if (ba->misses != bb->misses)
+    return (ba->misses < bb->misses) - (ba->misses > bb->misses);
+  return (ba->penalties < bb->penalties) - (ba->penalties > bb->penalties);
+}
+
+// Find the range of the region map holding 'addr'
+// Returns its index, or -1 if no range holds it
+//
+int
+find_range(uint64_t addr) {
+  int lo = 0, hi = numRanges - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (ranges[mid].start <= addr) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return (found >= 0 && addr < ranges[found].end) ? found : -1;
+}
+
+struct bucket *
+find_bucket(uint64_t key) {
+  uint32_t mask = numBuckets - 1;
+  uint32_t slot = (key * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+  while (buckets[slot].key && buckets[slot].key != key)
+    slot = (slot + 1) & mask;
+  return &buckets[slot];
+}
+
+// Double the size of the hash table
+//
+void
+grow_buckets() {
+  struct bucket *old = buckets;
+  uint32_t oldSize = numBuckets;
+
+  numBuckets *= 2;
+  buckets = calloc(numBuckets, sizeof(struct bucket));
+  for (uint32_t i = 0; i < oldSize; i++)
+    if (old[i].key)
+      *find_bucket(old[i].key) = old[i];
+  free(old);
+}
+
+//------------------------------------//
+//       Attribution Functions        //
+//------------------------------------//
+
+int
+load_region_map(const char *file)
+{
+  FILE *in = fopen(file, "r");
+  if (!in) {
+    fprintf(stderr,"Unable to open region map '%s'\n", file);
+    return 0;
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  int lineNo = 0;
+  while (getline(&line, &len, in) != -1) {
+    lineNo++;
+    uint64_t start, end;
+    char name[256];
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+    if (sscanf(line, "%lx %lx %255s", &start, &end, name) != 3 || end <= start) {
+      fprintf(stderr,"Bad range on line %d of region map '%s'\n", lineNo, file);
+      fclose(in);
+      free(line);
+      return 0;
+    }
+    ranges = realloc(ranges, (numRanges + 1) * sizeof(struct range));
+    ranges[numRanges].start = start;
+    ranges[numRanges].end = end;
+    ranges[numRanges].name = strdup(name);
+    numRanges++;
+  }
+  fclose(in);
+  free(line);
+
+  qsort(ranges, numRanges, sizeof(struct range), compare_ranges);
+  return 1;
+}
+
+void
+init_attribution()
+{
+  regionBits = 0;
+  while (attributeRegion > 1 && (1u << regionBits) < attributeRegion)
+    regionBits++;
+
+  numBuckets = 1024;
+  usedBuckets = 0;
+  buckets = calloc(numBuckets, sizeof(struct bucket));
+  attributeMisses = TRUE;
+}
+
+void
+attribute_miss(int level, uint64_t addr, uint32_t penalty)
+{
+  uint64_t key;
+  int r = numRanges ? find_range(addr) : -1;
+  if (r >= 0) {
+    key = ((uint64_t)r << 3 | KEY_MAPPED | level) + 1;
+  } else if (attributeRegion) {
+    key = ((uint64_t)(addr >> regionBits) << 3 | level) + 1;
+  } else {
+    return; // outside of the map and no regions to fall back on
+  }
+
+  struct bucket *b = find_bucket(key);
+  if (!b->key) {
+    if (2 * (usedBuckets + 1) > numBuckets) {
+      grow_buckets();
+      b = find_bucket(key);
+    }
+    b->key = key;
+    usedBuckets++;
+  }
+  b->misses++;
+  b->penalties += penalty;
+}
+
+void
+printAttribution()
+{
+  const char *names[] = { "I-cache", "D-cache", "L2-cache" };
+  const uint32_t sets[] = { icacheSets, dcacheSets, l2cacheSets };
+  const uint64_t misses[] = { icacheMisses, dcacheMisses, l2cacheMisses };
+  const int digits = (addressSize + 3) / 4;
+
+  // Gather the buckets of each level, most misses first
+  struct bucket *sorted = malloc(usedBuckets * sizeof(struct bucket));
+
+  printf("Miss Attribution:\n");
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    if (!sets[level])
+      continue;
+
+    int n = 0;
+    for (uint32_t i = 0; i < numBuckets; i++)
+      if (buckets[i].key && ((buckets[i].key - 1) & 3) == level)
+        sorted[n++] = buckets[i];
+    qsort(sorted, n, sizeof(struct bucket), compare_buckets);
+
+    char title[32];
+    snprintf(title, sizeof(title), "%s regions:", names[level]);
+    printf("  %-*s%10s %9s %12s\n", 2 * digits + 9, title,
+        "misses", "% total", "penalties");
+    for (int i = 0; i < n && i < attributeTopK; i++) {
+      uint64_t key = sorted[i].key - 1;
+      if (key & KEY_MAPPED) {
+        printf("    %-*.*s", 2 * digits + 7, 2 * digits + 7, ranges[key >> 3].name);
+      } else {
+        uint64_t start = (key >> 3) << regionBits;
+        printf("    0x%0*lx-0x%0*lx  ", digits, start,
+            digits, start + (attributeRegion - 1));
+      }
+      printf("%10lu %8.2f%% %12lu\n", sorted[i].misses,
+          misses[level] ? 100.0*(double)sorted[i].misses/misses[level] : 0.0,
+          sorted[i].penalties);
+    }
+    if (n == 0) {
+      printf("    -\n");
+    }
+  }
+
+  free(sorted);
+}
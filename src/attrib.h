@@ -0,0 +1,45 @@
+//========================================================//
+//  attrib.h                                              //
+//  Header file for the miss attribution of the           //
+//  Cache Simulator                                       //
+//                                                        //
+//  Buckets the misses and penalties of each cache by     //
+//  address region                                        //
+//========================================================//
+
+#ifndef ATTRIB_H
+#define ATTRIB_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//      Attribution Configuration     //
+//------------------------------------//
+
+extern __thread uint32_t attributeRegion;  // Size of an address region in bytes
+extern __thread uint32_t attributeTopK;    // Number of regions to report per cache
+extern __thread int      attributeMisses;  // Indicates if misses are being attributed
+
+//------------------------------------//
+//   Attribution Function Prototypes  //
+//------------------------------------//
+
+// Load a map of named address ranges from 'file'. Each line holds the first
+// and one past the last address of a range, in hex, followed by its name
+// Returns True if Successful
+//
+int load_region_map(const char *file);
+
+// Initialize the attribution tables
+//
+void init_attribution();
+
+// Attribute a miss of 'level' at address 'addr' costing 'penalty' cycles
+//
+void attribute_miss(int level, uint64_t addr, uint32_t penalty);
+
+// Print out the regions with the most misses for every cache
+//
+void printAttribution();
+
+#endif
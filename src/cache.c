@@ -6,9 +6,16 @@
 //  described in the README                               //
 //========================================================//
 
+#define _GNU_SOURCE
 #include "cache.h"
+#include "attrib.h"
 #include <stdio.h>
-#define ADDRESS_SIZE 32
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define ADDRESS_SIZE 64  // Width of the addresses handled by the simulator
 
 //
 // TODO:Student Information
@@ -21,56 +28,82 @@ const char *email       = "kchunt@eng.ucsd.edu, amt062@eng.ucsd.edu";
 //        Cache Configuration         //
 //------------------------------------//
 
-uint32_t icacheSets;     // Number of sets in the I$
-uint32_t icacheAssoc;    // Associativity of the I$
-uint32_t icacheHitTime;  // Hit Time of the I$
+__thread uint32_t icacheSets;     // Number of sets in the I$
+__thread uint32_t icacheAssoc;    // Associativity of the I$
+__thread uint32_t icacheHitTime;  // Hit Time of the I$
 
-uint32_t dcacheSets;     // Number of sets in the D$
-uint32_t dcacheAssoc;    // Associativity of the D$
-uint32_t dcacheHitTime;  // Hit Time of the D$
+__thread uint32_t dcacheSets;     // Number of sets in the D$
+__thread uint32_t dcacheAssoc;    // Associativity of the D$
+__thread uint32_t dcacheHitTime;  // Hit Time of the D$
 
-uint32_t l2cacheSets;    // Number of sets in the L2$
-uint32_t l2cacheAssoc;   // Associativity of the L2$
-uint32_t l2cacheHitTime; // Hit Time of the L2$
-uint32_t inclusive;      // Indicates if the L2 is inclusive
+__thread uint32_t l2cacheSets;    // Number of sets in the L2$
+__thread uint32_t l2cacheAssoc;   // Associativity of the L2$
+__thread uint32_t l2cacheHitTime; // Hit Time of the L2$
+__thread uint32_t inclusive;      // Indicates if the L2 is inclusive
 
-uint32_t blocksize;      // Block/Line size
-uint32_t memspeed;       // Latency of Main Memory
+__thread uint32_t icacheBlocksize;  // Block/Line size of the I$
+__thread uint32_t icacheSectorsize; // Sector size of the I$
+__thread uint32_t dcacheBlocksize;  // Block/Line size of the D$
+__thread uint32_t dcacheSectorsize; // Sector size of the D$
+__thread uint32_t l2cacheBlocksize; // Block/Line size of the L2$
+__thread uint32_t l2cacheSectorsize;// Sector size of the L2$
+
+__thread uint32_t blocksize;      // Block/Line size
+__thread uint32_t addressSize;    // Width of the trace addresses in bits
+__thread uint32_t memspeed;       // Latency of Main Memory
 
 //------------------------------------//
 //          Cache Statistics          //
 //------------------------------------//
 
-uint64_t icacheRefs;       // I$ references
-uint64_t icacheMisses;     // I$ misses
-uint64_t icachePenalties;  // I$ penalties
+__thread uint64_t icacheRefs;       // I$ references
+__thread uint64_t icacheMisses;     // I$ misses
+__thread uint64_t icachePenalties;  // I$ penalties
+
+__thread uint64_t dcacheRefs;       // D$ references
+__thread uint64_t dcacheMisses;     // D$ misses
+__thread uint64_t dcachePenalties;  // D$ penalties
+
+__thread uint64_t l2cacheRefs;      // L2$ references
+__thread uint64_t l2cacheMisses;    // L2$ misses
+__thread uint64_t l2cachePenalties; // L2$ penalties
+
+__thread uint64_t icacheSectorMisses;  // I$ misses on a valid line missing the sector
+__thread uint64_t dcacheSectorMisses;  // D$ misses on a valid line missing the sector
+__thread uint64_t l2cacheSectorMisses; // L2$ misses on a valid line missing the sector
+__thread uint64_t memoryBytes;         // Bytes fetched from main memory
+
+//------------------------------------//
+//     Victim/Miss Cache Buffers      //
+//------------------------------------//
 
-uint64_t dcacheRefs;       // D$ references
-uint64_t dcacheMisses;     // D$ misses
-uint64_t dcachePenalties;  // D$ penalties
+__thread uint32_t bufferKind[3];    // Kind of buffer behind each cache
+__thread uint32_t bufferEntries[3]; // Number of entries in the buffer
+__thread uint32_t bufferHitTime[3]; // Hit Time of the buffer
 
-uint64_t l2cacheRefs;      // L2$ references
-uint64_t l2cacheMisses;    // L2$ misses
-uint64_t l2cachePenalties; // L2$ penalties
+__thread uint64_t bufferProbes[3];  // Buffer probes (misses of the cache)
+__thread uint64_t bufferHits[3];    // Buffer hits
+__thread uint64_t bufferSwaps[3];   // Victim buffer hits that swapped a line back
 
 //------------------------------------//
 //        Cache Data Structures       //
 //------------------------------------//
 
-int blockoffsetBits;
-int icacheIndexBits;
-int dcacheIndexBits;
-int l2cacheIndexBits;
-int icacheTagBits;
-int dcacheTagBits;
-int l2cacheTagBits;
+__thread int icacheOffsetBits;
+__thread int dcacheOffsetBits;
+__thread int l2cacheOffsetBits;
+__thread int icacheIndexBits;
+__thread int dcacheIndexBits;
+__thread int l2cacheIndexBits;
+__thread int icacheTagBits;
+__thread int dcacheTagBits;
+__thread int l2cacheTagBits;
 
 struct way {
+  uint64_t tag;
   int validBit;
-  int tag;
-  int index;
-  int blockoffset;
   int lru;
+  uint32_t sectors;  // Valid bit of each sector of the line
 };
 
 struct set {
@@ -79,15 +112,101 @@ struct set {
 
 struct cache {
   struct set *sets;
+  struct way *ways;  // All ways of the cache, set after set
+  int level;         // ICACHE, DCACHE or L2CACHE
+  struct cache *buffer; // Victim or miss cache behind this cache, if any
+  int swapPending;   // Indicates the line being filled came from the buffer
+  uint32_t fillSectors; // Sectors the line being filled will hold
+  int numSets;
   int tagBits;
   int offsetBits;
+  int sectorBits;    // Bits of the offset that address a byte of a sector
   int associativity;
   int indexBits;
 };
 
-struct cache icache;
-struct cache dcache;
-struct cache l2cache;
+__thread struct cache icache;
+__thread struct cache dcache;
+__thread struct cache l2cache;
+
+// Victim/miss cache buffers are fully associative, modelled as a cache with
+// a single set
+//
+__thread struct cache buffers[3];
+
+// Layout of a checkpoint file. The header is followed by the ways of the
+// I$, D$ and L2$ and then of their buffers, in that order, exactly as they
+// are laid out in memory
+//
+#define CHECKPOINT_MAGIC   "CSIMCKPT"
+#define CHECKPOINT_VERSION 5
+
+struct checkpoint_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t waySize;
+  uint32_t blocksize;
+  uint32_t inclusive;
+  uint32_t icacheSets, icacheAssoc;
+  uint32_t dcacheSets, dcacheAssoc;
+  uint32_t l2cacheSets, l2cacheAssoc;
+  uint32_t icacheBlocksize, icacheSectorsize;
+  uint32_t dcacheBlocksize, dcacheSectorsize;
+  uint32_t l2cacheBlocksize, l2cacheSectorsize;
+  uint32_t icacheHitTime, dcacheHitTime, l2cacheHitTime, memspeed;
+  uint32_t bufferHitTime[3], reserved;
+  uint64_t icacheRefs, icacheMisses, icachePenalties;
+  uint64_t dcacheRefs, dcacheMisses, dcachePenalties;
+  uint64_t l2cacheRefs, l2cacheMisses, l2cachePenalties;
+  uint32_t bufferKind[3], bufferEntries[3];
+  uint64_t bufferProbes[3], bufferHits[3], bufferSwaps[3];
+  uint64_t icacheSectorMisses, dcacheSectorMisses, l2cacheSectorMisses;
+  uint64_t memoryBytes;
+  struct trace_state trace;
+};
+
+__thread void  *checkpointMap = NULL;  // Mapping of the restored checkpoint, if any
+__thread size_t checkpointMapSize = 0;
+
+// Layout of an L1-filtered trace. The header is followed by one record per
+// request that reached the L2. A record is two 32-bit words: the requested
+// address, then whether it came from the D$ (bit 0) and the L1 way the line
+// was filled into plus one (the remaining bits, 0 if no L1 was filled), which
+// lets a replay track which lines are held in the L1s for inclusive
+// back-invalidations. Traces with addresses wider than 32 bits add a third
+// word holding the upper half of the address
+//
+#define FILTER_MAGIC   "CSIML2TR"
+#define FILTER_VERSION 3
+
+struct filter_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t addressSize;
+  uint32_t blocksize;
+  uint32_t reserved;
+  uint32_t icacheSets, icacheAssoc;
+  uint32_t dcacheSets, dcacheAssoc;
+  uint32_t icacheBlocksize, icacheSectorsize;
+  uint32_t dcacheBlocksize, dcacheSectorsize;
+  uint64_t totalRefs;
+  uint64_t icacheRefs, icacheMisses, icacheSectorMisses;
+  uint64_t dcacheRefs, dcacheMisses, dcacheSectorMisses;
+  uint64_t numRecords;
+};
+
+struct filter_rec {
+  uint64_t addr;
+  uint32_t info;
+};
+
+__thread FILE *filterOut = NULL;       // L1-filtered trace being written, if any
+__thread struct filter_rec filterRec;  // Record for the reference being filtered
+__thread int filterPending;            // Indicates the reference reached the L2
+__thread uint64_t filterRecords;       // Records written so far
+
+__thread uint64_t l1Invalidations;     // Inclusive invalidations that hit an L1 line
+__thread int replayInexact;            // Indicates the L1s of a replay may differ
 
 //------------------------------------//
 //          Helper Functions          //
@@ -110,18 +229,18 @@ print_binary(uint32_t decimal) {
   printf("\n");
 }
 
-uint32_t
-parse_address(uint32_t address, int leftoffset, int rightoffset) {
-  uint32_t result = address << leftoffset;
+uint64_t
+parse_address(uint64_t address, int leftoffset, int rightoffset) {
+  uint64_t result = address << leftoffset;
   result = result >> leftoffset;
   result = result >> rightoffset;
   return result;
 }
 
-uint32_t
-rebuild_address(struct cache *cachePtr, uint32_t tag, uint32_t index, uint32_t blockoffset) {  
-  uint32_t newTag = tag << (cachePtr->indexBits + cachePtr->offsetBits);
-  uint32_t newIndex = index << (cachePtr->offsetBits);
+uint64_t
+rebuild_address(struct cache *cachePtr, uint64_t tag, uint32_t index) {
+  uint64_t newTag = tag << (cachePtr->indexBits + cachePtr->offsetBits);
+  uint64_t newIndex = (uint64_t)index << (cachePtr->offsetBits);
 
   return newTag + newIndex;
 }
@@ -134,33 +253,309 @@ update_lru(struct set *cacheSet, int wayIndex, int cacheAssoc) {
   
   cacheSet->nWays[wayIndex].lru = 1;
 }
- 
+
+// Return the valid bit of the sector of a line holding 'addr'
+//
+uint32_t
+sector_bit(struct cache *cachePtr, uint64_t addr) {
+  return 1u << parse_address(addr, ADDRESS_SIZE - cachePtr->offsetBits,
+                             cachePtr->sectorBits);
+}
+
+void buffer_insert(struct cache *buffer, uint64_t address, uint32_t sectors);
+
+// Fill a way with a new line holding the sectors of cachePtr->fillSectors
+//
+void
+fill_way(struct cache *cachePtr, uint32_t index, int wayIndex, uint64_t tag) {
+  struct way *way = &cachePtr->sets[index].nWays[wayIndex];
+
+  // a line evicted from the cache falls into its victim buffer
+  if (way->validBit && cachePtr->buffer &&
+      bufferKind[cachePtr->level] == BUFFER_VICTIM) {
+    if (cachePtr->swapPending)
+      bufferSwaps[cachePtr->level]++;
+    buffer_insert(cachePtr->buffer, rebuild_address(cachePtr, way->tag, index),
+                  way->sectors);
+  }
+  cachePtr->swapPending = FALSE;
+
+  update_lru(&cachePtr->sets[index], wayIndex, cachePtr->associativity);
+  way->tag = tag;
+  way->validBit = 1;
+  way->sectors = cachePtr->fillSectors;
+
+  if (filterOut && (cachePtr == &icache || cachePtr == &dcache))
+    filterRec.info |= (wayIndex + 1) << 1;
+}
+
+// Place the 'sectors' of the line holding 'address' in a buffer, adding
+// them to the entry already holding the line or else replacing an invalid
+// entry or the least recently used one
+//
 void
-invalidate(struct cache *cachePtr, uint32_t address) {
+buffer_insert(struct cache *buffer, uint64_t address, uint32_t sectors) {
+  struct way *ways = buffer->sets[0].nWays;
+  uint64_t tag = parse_address(address, 0, buffer->offsetBits);
+  for (int i = 0; i < buffer->associativity; i++) {
+    if (ways[i].tag == tag && ways[i].validBit == 1) {
+      ways[i].sectors |= sectors;
+      update_lru(&buffer->sets[0], i, buffer->associativity);
+      return;
+    }
+  }
+
+  int victim = 0;
+  for (int i = 0; i < buffer->associativity; i++) {
+    if (!ways[i].validBit) {
+      victim = i;
+      break;
+    }
+    if (ways[i].lru > ways[victim].lru)
+      victim = i;
+  }
+  buffer->fillSectors = sectors;
+  fill_way(buffer, 0, victim, tag);
+}
+
+// Look for the line holding 'addr' in the buffer behind a cache. A victim
+// buffer hands the line back to the cache, a miss cache keeps a copy
+// Returns True on a hit
+//
+int
+probe_buffer(struct cache *cachePtr, uint64_t addr) {
+  struct cache *buffer = cachePtr->buffer;
+  struct way *ways = buffer->sets[0].nWays;
+  uint64_t tag = parse_address(addr, 0, buffer->offsetBits);
+  uint32_t sector = sector_bit(cachePtr, addr);
+
+  bufferProbes[cachePtr->level]++;
+  for (int i = 0; i < buffer->associativity; i++) {
+    if (ways[i].tag == tag && ways[i].validBit == 1 && (ways[i].sectors & sector)) {
+      bufferHits[cachePtr->level]++;
+      cachePtr->fillSectors = ways[i].sectors;
+      if (bufferKind[cachePtr->level] == BUFFER_VICTIM) {
+        ways[i].validBit = 0;
+        cachePtr->swapPending = TRUE;
+      } else {
+        update_lru(&buffer->sets[0], i, buffer->associativity);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Fetch the missing sector holding 'addr' of a cache (the whole line if it
+// isn't sectored) from its buffer or else from the next level of the
+// hierarchy, and note the sectors the line will be filled with. The buffer
+// is probed while the request to the next level is already under way, so a
+// buffer miss costs nothing extra
+// Return the penalty of the miss
+//
+uint32_t
+fetch_line(struct cache *cachePtr, uint64_t addr) {
+  uint32_t penalty;
+
+  if (cachePtr->buffer && probe_buffer(cachePtr, addr)) {
+    penalty = bufferHitTime[cachePtr->level];
+  } else {
+    cachePtr->fillSectors = sector_bit(cachePtr, addr);
+
+    // an L1 without an L2 behind it fetches straight from main memory
+    if (cachePtr == &l2cache || (l2cacheSets == 0 && !filterOut)) {
+      penalty = memspeed;
+      memoryBytes += 1u << cachePtr->sectorBits;
+    } else {
+      penalty = l2cache_access(addr);
+    }
+
+    if (cachePtr->buffer && bufferKind[cachePtr->level] == BUFFER_MISS)
+      buffer_insert(cachePtr->buffer, addr, cachePtr->fillSectors);
+  }
+
+  if (attributeMisses)
+    attribute_miss(cachePtr->level, addr, penalty);
+
+  return penalty;
+}
+ 
+int
+invalidate(struct cache *cachePtr, uint64_t address) {
   uint32_t index = parse_address(address, cachePtr->tagBits, cachePtr->offsetBits);
-  uint32_t tag = parse_address(address, 0, cachePtr->indexBits + cachePtr->offsetBits);
-  uint32_t blockoffset = parse_address(address, cachePtr->tagBits + cachePtr->indexBits, 0);
+  uint64_t tag = parse_address(address, 0, cachePtr->indexBits + cachePtr->offsetBits);
+
+  // the buffer may hold a copy of the line, or some of its sectors, along
+  // with the cache itself, so both have to let go of it
+  int found = cachePtr->buffer && invalidate(cachePtr->buffer, address);
 
   struct set setTemp = cachePtr->sets[index];
   for (int i = 0; i < cachePtr->associativity; i++) {
     if(setTemp.nWays[i].tag == tag && setTemp.nWays[i].validBit == 1){
       cachePtr->sets[index].nWays[i].validBit = 0;
 
-      return;
+      return 1;
     }
   }
+  return found;
+}
+
+// Invalidate every line of a cache within the 'size' bytes at 'address'
+// Return the number of lines invalidated
+//
+int
+invalidate_range(struct cache *cachePtr, uint64_t address, uint32_t size) {
+  int found = 0;
+  if (cachePtr->numSets == 0)
+    return 0;
+
+  for (uint64_t a = address; a < address + size; a += 1u << cachePtr->offsetBits)
+    found += invalidate(cachePtr, a);
+  return found;
+}
+
+// Fetch the missing sector holding 'addr' of a valid line
+// Return the penalty of the miss
+//
+uint32_t
+fetch_sector(struct cache *cachePtr, struct way *way, uint64_t addr) {
+  uint32_t penalty = fetch_line(cachePtr, addr);
+  way->sectors |= cachePtr->fillSectors;
+
+  // the sectors of a victim buffer hit merge into the line, nothing is
+  // evicted in exchange
+  cachePtr->swapPending = FALSE;
+  return penalty;
 }
 
 //------------------------------------//
 //          Cache Functions           //
 //------------------------------------//
 
-// Initialize the Cache Hierarchy
+// Allocate the ways of a cache as one contiguous block, set after set, so
+// that the whole cache can be checkpointed and restored with a single copy
+//
+// Returns True if Successful
+//
+int
+alloc_cache(struct cache *cachePtr, int level, uint32_t sets, uint32_t assoc,
+            int indexBits, int offsetBits, int sectorBits)
+{
+  cachePtr->sets = malloc((size_t)sets * sizeof(struct set));
+  cachePtr->ways = malloc((size_t)sets * assoc * sizeof(struct way));
+  if ((sets && !cachePtr->sets) || (sets && assoc && !cachePtr->ways)) {
+    free(cachePtr->sets);
+    free(cachePtr->ways);
+    cachePtr->sets = NULL;
+    cachePtr->ways = NULL;
+    return 0;
+  }
+  for (uint32_t i = 0; i < sets; i++){
+    cachePtr->sets[i].nWays = &cachePtr->ways[(size_t)i * assoc];
+    for (int j = 0; j < assoc; j++) {
+      cachePtr->sets[i].nWays[j].validBit = 0;
+      cachePtr->sets[i].nWays[j].tag = 0;
+      cachePtr->sets[i].nWays[j].lru = assoc;
+      cachePtr->sets[i].nWays[j].sectors = 0;
+    }
+  }
+  cachePtr->level = level;
+  cachePtr->buffer = NULL;
+  cachePtr->swapPending = FALSE;
+  cachePtr->fillSectors = 0;
+  cachePtr->numSets = sets;
+  cachePtr->tagBits = ADDRESS_SIZE - indexBits - offsetBits;
+  cachePtr->offsetBits = offsetBits;
+  cachePtr->sectorBits = sectorBits;
+  cachePtr->associativity = assoc;
+  cachePtr->indexBits = indexBits;
+  return 1;
+}
+
+// Point the sets of a cache at a new block of ways
 //
 void
+remap_cache(struct cache *cachePtr, struct way *ways)
+{
+  if (!checkpointMap) {
+    free(cachePtr->ways);
+  }
+  cachePtr->ways = ways;
+  for (int i = 0; i < cachePtr->numSets; i++)
+    cachePtr->sets[i].nWays = &ways[(size_t)i * cachePtr->associativity];
+}
+
+// Initialize the Cache Hierarchy
+//
+int
 init_cache()
 {
   // Initialize cache stats
+  reset_cache_stats();
+  
+  // Initialize cache data structures
+  icacheIndexBits = log2(icacheSets);
+  dcacheIndexBits = log2(dcacheSets);
+  l2cacheIndexBits = log2(l2cacheSets);
+  icacheOffsetBits = log2(icacheBlocksize);
+  dcacheOffsetBits = log2(dcacheBlocksize);
+  l2cacheOffsetBits = log2(l2cacheBlocksize);
+  icacheTagBits = ADDRESS_SIZE - icacheIndexBits - icacheOffsetBits;
+  dcacheTagBits = ADDRESS_SIZE - dcacheIndexBits - dcacheOffsetBits;
+  l2cacheTagBits = ADDRESS_SIZE - l2cacheIndexBits - l2cacheOffsetBits;
+  
+  int ok =
+    alloc_cache(&icache, ICACHE, icacheSets, icacheAssoc, icacheIndexBits,
+                icacheOffsetBits, log2(icacheSectorsize)) &&
+    alloc_cache(&dcache, DCACHE, dcacheSets, dcacheAssoc, dcacheIndexBits,
+                dcacheOffsetBits, log2(dcacheSectorsize)) &&
+    alloc_cache(&l2cache, L2CACHE, l2cacheSets, l2cacheAssoc, l2cacheIndexBits,
+                l2cacheOffsetBits, log2(l2cacheSectorsize));
+
+  // Attach the victim/miss cache buffers
+  struct cache *levels[] = { &icache, &dcache, &l2cache };
+  for (int level = ICACHE; ok && level <= L2CACHE; level++) {
+    if (bufferKind[level] != BUFFER_NONE) {
+      ok = alloc_cache(&buffers[level], level, 1, bufferEntries[level], 0,
+                       levels[level]->offsetBits, levels[level]->sectorBits);
+      levels[level]->buffer = ok ? &buffers[level] : NULL;
+    }
+  }
+
+  if (!ok) {
+    free_cache();
+  }
+  return ok;
+}
+
+// Free the data structures of the Cache Hierarchy
+//
+void
+free_cache()
+{
+  struct cache *caches[] = { &icache, &dcache, &l2cache, &buffers[ICACHE],
+                             &buffers[DCACHE], &buffers[L2CACHE] };
+  for (int i = 0; i < 6; i++) {
+    free(caches[i]->sets);
+    if (!checkpointMap) {
+      free(caches[i]->ways);
+    }
+    caches[i]->sets = NULL;
+    caches[i]->ways = NULL;
+    caches[i]->buffer = NULL;
+  }
+
+  if (checkpointMap) {
+    munmap(checkpointMap, checkpointMapSize);
+    checkpointMap = NULL;
+  }
+}
+
+// Zero all of the cache statistics
+//
+void
+reset_cache_stats()
+{
   icacheRefs        = 0;
   icacheMisses      = 0;
   icachePenalties   = 0;
@@ -170,77 +565,248 @@ init_cache()
   l2cacheRefs       = 0;
   l2cacheMisses     = 0;
   l2cachePenalties  = 0;
-  
-  // Initialize cache data structures
-  icacheIndexBits = log2(icacheSets);
-  dcacheIndexBits = log2(dcacheSets);
-  l2cacheIndexBits = log2(l2cacheSets);
-  blockoffsetBits = log2(blocksize);
-  icacheTagBits = ADDRESS_SIZE - icacheIndexBits - blockoffsetBits;
-  dcacheTagBits = ADDRESS_SIZE - dcacheIndexBits - blockoffsetBits;
-  l2cacheTagBits = ADDRESS_SIZE - l2cacheIndexBits - blockoffsetBits;
-  
-  icache.sets = malloc(icacheSets * sizeof(struct set));
-  for (int i = 0; i < icacheSets; i++){
-    icache.sets[i].nWays = malloc(icacheAssoc * sizeof(struct way));
-    for (int j = 0; j < icacheAssoc; j++) {
-      icache.sets[i].nWays[j].validBit = 0;
-      icache.sets[i].nWays[j].tag = 0;
-      icache.sets[i].nWays[j].index = 0;
-      icache.sets[i].nWays[j].blockoffset = 0;
-      icache.sets[i].nWays[j].lru = icacheAssoc;
-    }
+
+  icacheSectorMisses  = 0;
+  dcacheSectorMisses  = 0;
+  l2cacheSectorMisses = 0;
+  memoryBytes         = 0;
+  l1Invalidations     = 0;
+  replayInexact       = FALSE;
+
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    bufferProbes[level] = 0;
+    bufferHits[level]   = 0;
+    bufferSwaps[level]  = 0;
   }
-  icache.tagBits = icacheTagBits;
-  icache.offsetBits = blockoffsetBits;
-  icache.associativity = icacheAssoc;
-  icache.indexBits = icacheIndexBits;
-
-  dcache.sets = malloc(dcacheSets * sizeof(struct set));
-  for (int i = 0; i < dcacheSets; i++){
-    dcache.sets[i].nWays = malloc(dcacheAssoc * sizeof(struct way));
-    for (int j = 0; j < dcacheAssoc; j++) {
-      dcache.sets[i].nWays[j].validBit = 0;
-      dcache.sets[i].nWays[j].tag = 0;
-      dcache.sets[i].nWays[j].index = 0;
-      dcache.sets[i].nWays[j].blockoffset = 0;
-      dcache.sets[i].nWays[j].lru = dcacheAssoc;
+}
+
+// Write the contents of every cache, the statistics and the trace state 'ts'
+// to the checkpoint file 'file'
+//
+// Returns True if Successful
+//
+int
+checkpoint_cache(const char *file, struct trace_state *ts)
+{
+  struct checkpoint_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+  hdr.version          = CHECKPOINT_VERSION;
+  hdr.waySize          = sizeof(struct way);
+  hdr.blocksize        = blocksize;
+  hdr.inclusive        = inclusive;
+  hdr.icacheSets       = icacheSets;
+  hdr.icacheAssoc      = icacheAssoc;
+  hdr.dcacheSets       = dcacheSets;
+  hdr.dcacheAssoc      = dcacheAssoc;
+  hdr.l2cacheSets      = l2cacheSets;
+  hdr.l2cacheAssoc     = l2cacheAssoc;
+  hdr.icacheBlocksize  = icacheBlocksize;
+  hdr.icacheSectorsize = icacheSectorsize;
+  hdr.dcacheBlocksize  = dcacheBlocksize;
+  hdr.dcacheSectorsize = dcacheSectorsize;
+  hdr.l2cacheBlocksize = l2cacheBlocksize;
+  hdr.l2cacheSectorsize = l2cacheSectorsize;
+  hdr.icacheHitTime    = icacheHitTime;
+  hdr.dcacheHitTime    = dcacheHitTime;
+  hdr.l2cacheHitTime   = l2cacheHitTime;
+  hdr.memspeed         = memspeed;
+  hdr.icacheRefs       = icacheRefs;
+  hdr.icacheMisses     = icacheMisses;
+  hdr.icachePenalties  = icachePenalties;
+  hdr.dcacheRefs       = dcacheRefs;
+  hdr.dcacheMisses     = dcacheMisses;
+  hdr.dcachePenalties  = dcachePenalties;
+  hdr.l2cacheRefs      = l2cacheRefs;
+  hdr.l2cacheMisses    = l2cacheMisses;
+  hdr.l2cachePenalties = l2cachePenalties;
+  hdr.icacheSectorMisses  = icacheSectorMisses;
+  hdr.dcacheSectorMisses  = dcacheSectorMisses;
+  hdr.l2cacheSectorMisses = l2cacheSectorMisses;
+  hdr.memoryBytes         = memoryBytes;
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    hdr.bufferKind[level]    = bufferKind[level];
+    hdr.bufferEntries[level] = bufferEntries[level];
+    hdr.bufferHitTime[level] = bufferHitTime[level];
+    hdr.bufferProbes[level]  = bufferProbes[level];
+    hdr.bufferHits[level]    = bufferHits[level];
+    hdr.bufferSwaps[level]   = bufferSwaps[level];
+  }
+  hdr.trace            = *ts;
+
+  // The checkpoint may replace one that is mapped, by this run if it was
+  // restored from it or by others, so it is written aside and renamed into
+  // place rather than truncated
+  size_t tmpSize = strlen(file) + 32;
+  char *tmp = malloc(tmpSize);
+  snprintf(tmp, tmpSize, "%s.tmp%d", file, (int)getpid());
+  FILE *out = fopen(tmp, "wb");
+  if (!out) {
+    fprintf(stderr,"Unable to open checkpoint '%s' for writing\n", file);
+    free(tmp);
+    return 0;
+  }
+
+  int ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+  ok = ok && fwrite(icache.ways, sizeof(struct way),
+                    icacheSets * icacheAssoc, out) == icacheSets * icacheAssoc;
+  ok = ok && fwrite(dcache.ways, sizeof(struct way),
+                    dcacheSets * dcacheAssoc, out) == dcacheSets * dcacheAssoc;
+  ok = ok && fwrite(l2cache.ways, sizeof(struct way),
+                    l2cacheSets * l2cacheAssoc, out) == l2cacheSets * l2cacheAssoc;
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    if (bufferKind[level] != BUFFER_NONE) {
+      ok = ok && fwrite(buffers[level].ways, sizeof(struct way),
+                        bufferEntries[level], out) == bufferEntries[level];
     }
   }
-  dcache.tagBits = dcacheTagBits;
-  dcache.offsetBits = blockoffsetBits;
-  dcache.associativity = dcacheAssoc;
-  dcache.indexBits = dcacheIndexBits;
-
-  l2cache.sets = malloc(l2cacheSets * sizeof(struct set));
-  for (int i = 0; i < l2cacheSets; i++){
-    l2cache.sets[i].nWays = malloc(l2cacheAssoc * sizeof(struct way));
-    for (int j = 0; j < l2cacheAssoc; j++) {
-      l2cache.sets[i].nWays[j].validBit = 0;
-      l2cache.sets[i].nWays[j].tag = 0;
-      l2cache.sets[i].nWays[j].index = 0;
-      l2cache.sets[i].nWays[j].blockoffset = 0;
-      l2cache.sets[i].nWays[j].lru = l2cacheAssoc;
+  ok = (fclose(out) == 0) && ok;
+  ok = ok && rename(tmp, file) == 0;
+
+  if (!ok) {
+    fprintf(stderr,"Error writing checkpoint '%s'\n", file);
+    unlink(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+// Restore the contents of every cache and the statistics from the checkpoint
+// file 'file', and return the saved trace state in 'ts'. The file is mapped
+// copy-on-write and the caches are pointed straight into the mapping, so the
+// restore costs no more than the pages the simulation goes on to touch.
+// The cache geometry and inclusion must match the ones the checkpoint was
+// taken with.
+//
+// Returns True if Successful
+//
+int
+restore_cache(const char *file, struct trace_state *ts, int resetStats)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr,"Unable to open checkpoint '%s'\n", file);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct checkpoint_header)) {
+    fprintf(stderr,"Checkpoint '%s' is truncated\n", file);
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"Unable to map checkpoint '%s'\n", file);
+    return 0;
+  }
+
+  struct checkpoint_header *hdr = map;
+  size_t nWays = (size_t)icacheSets * icacheAssoc +
+                 (size_t)dcacheSets * dcacheAssoc +
+                 (size_t)l2cacheSets * l2cacheAssoc;
+  int sameBuffers = TRUE;
+  int sameLatencies = hdr->icacheHitTime == icacheHitTime &&
+                      hdr->dcacheHitTime == dcacheHitTime &&
+                      hdr->l2cacheHitTime == l2cacheHitTime &&
+                      hdr->memspeed == memspeed;
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    if (bufferKind[level] != BUFFER_NONE)
+      nWays += bufferEntries[level];
+    sameBuffers = sameBuffers && hdr->bufferKind[level] == bufferKind[level] &&
+                  (bufferKind[level] == BUFFER_NONE ||
+                   hdr->bufferEntries[level] == bufferEntries[level]);
+    sameLatencies = sameLatencies && (bufferKind[level] == BUFFER_NONE ||
+                    hdr->bufferHitTime[level] == bufferHitTime[level]);
+  }
+
+  if (memcmp(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != CHECKPOINT_VERSION ||
+      hdr->waySize != sizeof(struct way)) {
+    fprintf(stderr,"'%s' is not a valid checkpoint\n", file);
+    munmap(map, st.st_size);
+    return 0;
+  }
+  if (hdr->blocksize != blocksize || hdr->inclusive != inclusive ||
+      hdr->icacheSets != icacheSets || hdr->icacheAssoc != icacheAssoc ||
+      hdr->dcacheSets != dcacheSets || hdr->dcacheAssoc != dcacheAssoc ||
+      hdr->l2cacheSets != l2cacheSets || hdr->l2cacheAssoc != l2cacheAssoc ||
+      hdr->icacheBlocksize != icacheBlocksize ||
+      hdr->icacheSectorsize != icacheSectorsize ||
+      hdr->dcacheBlocksize != dcacheBlocksize ||
+      hdr->dcacheSectorsize != dcacheSectorsize ||
+      hdr->l2cacheBlocksize != l2cacheBlocksize ||
+      hdr->l2cacheSectorsize != l2cacheSectorsize ||
+      !sameBuffers ||
+      st.st_size != sizeof(*hdr) + nWays * sizeof(struct way)) {
+    fprintf(stderr,"Checkpoint '%s' was taken with a different hierarchy\n", file);
+    munmap(map, st.st_size);
+    return 0;
+  }
+  // The penalties counted so far can't be mixed with those of other latencies
+  if (!sameLatencies && !resetStats) {
+    fprintf(stderr,"Checkpoint '%s' was taken with other latencies, "
+            "restore it with --reset-stats\n", file);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  icacheRefs       = hdr->icacheRefs;
+  icacheMisses     = hdr->icacheMisses;
+  icachePenalties  = hdr->icachePenalties;
+  dcacheRefs       = hdr->dcacheRefs;
+  dcacheMisses     = hdr->dcacheMisses;
+  dcachePenalties  = hdr->dcachePenalties;
+  l2cacheRefs      = hdr->l2cacheRefs;
+  l2cacheMisses    = hdr->l2cacheMisses;
+  l2cachePenalties = hdr->l2cachePenalties;
+  icacheSectorMisses  = hdr->icacheSectorMisses;
+  dcacheSectorMisses  = hdr->dcacheSectorMisses;
+  l2cacheSectorMisses = hdr->l2cacheSectorMisses;
+  memoryBytes         = hdr->memoryBytes;
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    bufferProbes[level] = hdr->bufferProbes[level];
+    bufferHits[level]   = hdr->bufferHits[level];
+    bufferSwaps[level]  = hdr->bufferSwaps[level];
+  }
+  *ts = hdr->trace;
+
+  struct way *ways = (struct way *)(hdr + 1);
+  remap_cache(&icache, ways);
+  ways += icacheSets * icacheAssoc;
+  remap_cache(&dcache, ways);
+  ways += dcacheSets * dcacheAssoc;
+  remap_cache(&l2cache, ways);
+  ways += l2cacheSets * l2cacheAssoc;
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    if (bufferKind[level] != BUFFER_NONE) {
+      remap_cache(&buffers[level], ways);
+      ways += bufferEntries[level];
     }
   }
-  l2cache.tagBits = l2cacheTagBits;
-  l2cache.offsetBits = blockoffsetBits;
-  l2cache.associativity = l2cacheAssoc;
-  l2cache.indexBits = l2cacheIndexBits;
+
+  if (checkpointMap) {
+    munmap(checkpointMap, checkpointMapSize);
+  }
+  checkpointMap = map;
+  checkpointMapSize = st.st_size;
+
+  return 1;
 }
 
 // Perform a memory access through the icache interface for the address 'addr'
 // Return the access time for the memory operation
 //
 uint32_t
-icache_access(uint32_t addr)
+icache_access(uint64_t addr)
 {
   if(icacheSets > 0){
     icacheRefs++;
     uint32_t pen = 0;
-    uint32_t index = parse_address(addr, icacheTagBits, blockoffsetBits);
-    uint32_t tag = parse_address(addr, 0, icacheIndexBits + blockoffsetBits);
-    uint32_t blockoffset = parse_address(addr, icacheTagBits + icacheIndexBits, 0);
+    uint32_t index = parse_address(addr, icacheTagBits, icacheOffsetBits);
+    uint64_t tag = parse_address(addr, 0, icacheIndexBits + icacheOffsetBits);
 
     // index into the cache
     struct set setTemp = icache.sets[index];
@@ -251,6 +817,15 @@ icache_access(uint32_t addr)
         if(setTemp.nWays[i].validBit == 1) { // hit!
           // update the cache
           update_lru(&icache.sets[index], i, icacheAssoc);
+
+          // the line is here but the sector may not be
+          if(!(setTemp.nWays[i].sectors & sector_bit(&icache, addr))) {
+            icacheMisses++;
+            icacheSectorMisses++;
+            int icachePenalty = fetch_sector(&icache, &setTemp.nWays[i], addr);
+            icachePenalties += icachePenalty;
+            return icachePenalty + icacheHitTime;
+          }
           return icacheHitTime;
         }
 
@@ -270,15 +845,11 @@ icache_access(uint32_t addr)
     if (indexOfInvalid > 0) {
       // call l2cache_access to check if it has a hit
       // it returns memspeed if it doesn't have it, l2 hit time if it does
-      int icachePenalty = l2cache_access(addr);
+      int icachePenalty = fetch_line(&icache, addr);
       icachePenalties += icachePenalty;
 
       // update the cache
-      update_lru(&icache.sets[index], indexOfInvalid, icacheAssoc);
-      icache.sets[index].nWays[indexOfInvalid].tag = tag;
-      icache.sets[index].nWays[indexOfInvalid].index = index;
-      icache.sets[index].nWays[indexOfInvalid].blockoffset = blockoffset; 
-      icache.sets[index].nWays[indexOfInvalid].validBit = 1;
+      fill_way(&icache, index, indexOfInvalid, tag);
 
       return icachePenalty + icacheHitTime; 
     } 
@@ -287,34 +858,26 @@ icache_access(uint32_t addr)
     // find the LRU
     for (int i = 0; i < icacheAssoc; i++) {
       if (setTemp.nWays[i].lru == icacheAssoc) { // found LRU
-        int icachePenalty = l2cache_access(addr);
+        int icachePenalty = fetch_line(&icache, addr);
         icachePenalties += icachePenalty;
 
         // check if l2 invalidated an entry so we can avoid kicking out a valid one
         for (int j = 0; j < icacheAssoc; j++) {
           if(setTemp.nWays[j].validBit == 0) {
             // update the cache
-            update_lru(&icache.sets[index], j, icacheAssoc);
-            icache.sets[index].nWays[j].tag = tag;
-            icache.sets[index].nWays[j].index = index;
-            icache.sets[index].nWays[j].blockoffset = blockoffset;
-            icache.sets[index].nWays[j].validBit = 1; 
+            fill_way(&icache, index, j, tag);
             return icachePenalty + icacheHitTime;
           }
         }
 
         // update the cache
-        update_lru(&icache.sets[index], i, icacheAssoc);
-        icache.sets[index].nWays[i].tag = tag;
-        icache.sets[index].nWays[i].index = index;
-        icache.sets[index].nWays[i].blockoffset = blockoffset;
-        icache.sets[index].nWays[i].validBit = 1; 
+        fill_way(&icache, index, i, tag);
 
         return icachePenalty + icacheHitTime;
       }
     } 
 
-    icachePenalties += l2cache_access(addr);
+    icachePenalties += fetch_line(&icache, addr);
     return icachePenalties + icacheHitTime;
 
   } else {
@@ -326,14 +889,13 @@ icache_access(uint32_t addr)
 // Return the access time for the memory operation
 //
 uint32_t
-dcache_access(uint32_t addr)
+dcache_access(uint64_t addr)
 {
   if(dcacheSets > 0){
     dcacheRefs++;
 
-    uint32_t index = parse_address(addr, dcacheTagBits, blockoffsetBits);
-    uint32_t tag = parse_address(addr, 0, dcacheIndexBits + blockoffsetBits);
-    uint32_t blockoffset = parse_address(addr, dcacheTagBits + dcacheIndexBits, 0);
+    uint32_t index = parse_address(addr, dcacheTagBits, dcacheOffsetBits);
+    uint64_t tag = parse_address(addr, 0, dcacheIndexBits + dcacheOffsetBits);
 
     // index into the cache
     struct set setTemp = dcache.sets[index];
@@ -344,6 +906,15 @@ dcache_access(uint32_t addr)
         if(setTemp.nWays[i].validBit == 1) { // hit!
           // update the cache
           update_lru(&dcache.sets[index], i, dcacheAssoc);
+
+          // the line is here but the sector may not be
+          if(!(setTemp.nWays[i].sectors & sector_bit(&dcache, addr))) {
+            dcacheMisses++;
+            dcacheSectorMisses++;
+            int dcachePenalty = fetch_sector(&dcache, &setTemp.nWays[i], addr);
+            dcachePenalties += dcachePenalty;
+            return dcachePenalty + dcacheHitTime;
+          }
           return dcacheHitTime;
         }
 
@@ -363,14 +934,10 @@ dcache_access(uint32_t addr)
     if (indexOfInvalid > 0) {
       // call l2cache_access to check if it has a hit
       // it returns memspeed if it doesn't have it, l2 hit time if it does
-      int dcachePenalty = l2cache_access(addr);
+      int dcachePenalty = fetch_line(&dcache, addr);
 
       // update the cache
-      update_lru(&dcache.sets[index], indexOfInvalid, dcacheAssoc);
-      dcache.sets[index].nWays[indexOfInvalid].tag = tag;
-      dcache.sets[index].nWays[indexOfInvalid].index = index;
-      dcache.sets[index].nWays[indexOfInvalid].blockoffset = blockoffset; 
-      dcache.sets[index].nWays[indexOfInvalid].validBit = 1;
+      fill_way(&dcache, index, indexOfInvalid, tag);
 
       dcachePenalties += dcachePenalty;
       return dcachePenalty + dcacheHitTime;
@@ -380,35 +947,27 @@ dcache_access(uint32_t addr)
     // find the LRU
     for (int i = 0; i < dcacheAssoc; i++) {
       if (setTemp.nWays[i].lru == dcacheAssoc) { // found LRU
-        int dcachePenalty = l2cache_access(addr);
+        int dcachePenalty = fetch_line(&dcache, addr);
         dcachePenalties += dcachePenalty;
 
         // check if l2 invalidated an entry so we can avoid kicking out a valid one
         for (int j = 0; j < dcacheAssoc; j++) {
           if(setTemp.nWays[j].validBit == 0) {
             // update the cache
-            update_lru(&dcache.sets[index], j, dcacheAssoc);
-            dcache.sets[index].nWays[j].tag = tag;
-            dcache.sets[index].nWays[j].index = index;
-            dcache.sets[index].nWays[j].blockoffset = blockoffset;
-            dcache.sets[index].nWays[j].validBit = 1; 
+            fill_way(&dcache, index, j, tag);
             
             return dcachePenalty + dcacheHitTime;
           }
         }
 
         // update the cache
-        update_lru(&dcache.sets[index], i, dcacheAssoc);
-        dcache.sets[index].nWays[i].tag = tag;
-        dcache.sets[index].nWays[i].index = index;
-        dcache.sets[index].nWays[i].blockoffset = blockoffset;
-        dcache.sets[index].nWays[i].validBit = 1; 
+        fill_way(&dcache, index, i, tag);
 
         return dcachePenalty + dcacheHitTime;
       }
     } 
 
-    int dcachePenalty = l2cache_access(addr);
+    int dcachePenalty = fetch_line(&dcache, addr);
     dcachePenalties += dcachePenalty;
     return dcachePenalty + dcacheHitTime;
 
@@ -421,13 +980,24 @@ dcache_access(uint32_t addr)
 // Return the access time for the memory operation
 //
 uint32_t
-l2cache_access(uint32_t addr)
+l2cache_access(uint64_t addr)
 {
+  if (filterOut) { // only record the request while filtering
+    filterRec.addr = addr;
+    filterPending = TRUE;
+    return 0;
+  }
+
+  // without an L2 the request goes straight to main memory
+  if (l2cacheSets == 0) {
+    memoryBytes += l2cacheSectorsize;
+    return memspeed;
+  }
+
   l2cacheRefs++;
 
-  uint32_t index = parse_address(addr, l2cacheTagBits, blockoffsetBits);
-  uint32_t tag = parse_address(addr, 0, l2cacheIndexBits + blockoffsetBits);
-  uint32_t blockoffset = parse_address(addr, l2cacheTagBits + l2cacheIndexBits, 0);
+  uint32_t index = parse_address(addr, l2cacheTagBits, l2cacheOffsetBits);
+  uint64_t tag = parse_address(addr, 0, l2cacheIndexBits + l2cacheOffsetBits);
 
   // index into the cache
   struct set setTemp = l2cache.sets[index];
@@ -438,6 +1008,15 @@ l2cache_access(uint32_t addr)
       if(setTemp.nWays[i].validBit == 1) { // hit!
         // update the cache
         update_lru(&l2cache.sets[index], i, l2cacheAssoc);
+
+        // the line is here but the sector may not be
+        if(!(setTemp.nWays[i].sectors & sector_bit(&l2cache, addr))) {
+          l2cacheMisses++;
+          l2cacheSectorMisses++;
+          int l2cachePenalty = fetch_sector(&l2cache, &setTemp.nWays[i], addr);
+          l2cachePenalties += l2cachePenalty;
+          return l2cachePenalty + l2cacheHitTime;
+        }
         return l2cacheHitTime;
       }
 
@@ -455,17 +1034,13 @@ l2cache_access(uint32_t addr)
   
   // check if we have room for the entry
   if (indexOfInvalid > 0) {
-    // update the cache
-    update_lru(&l2cache.sets[index], indexOfInvalid, l2cacheAssoc);
-    l2cache.sets[index].nWays[indexOfInvalid].tag = tag;
-    l2cache.sets[index].nWays[indexOfInvalid].index = index;
-    l2cache.sets[index].nWays[indexOfInvalid].blockoffset = blockoffset; 
-    l2cache.sets[index].nWays[indexOfInvalid].validBit = 1;
-
-    // call l2cache_access to check if it has a hit
-    // it returns memspeed if it doesn't have it, l2 hit time if it does
-    int l2cachePenalty = memspeed;
+    // fetch the line from memory
+    int l2cachePenalty = fetch_line(&l2cache, addr);
     l2cachePenalties += l2cachePenalty;
+
+    // update the cache
+    fill_way(&l2cache, index, indexOfInvalid, tag);
+
     return l2cachePenalty + l2cacheHitTime;
   } 
   
@@ -475,28 +1050,222 @@ l2cache_access(uint32_t addr)
     if (setTemp.nWays[i].lru == l2cacheAssoc) { // found LRU
 
       if(inclusive == TRUE) { //invalidate L1 cache victim
-        uint32_t invalidAddress = rebuild_address(&l2cache, 
+        uint64_t invalidAddress = rebuild_address(&l2cache, 
         setTemp.nWays[i].tag, 
-        index, 
-        setTemp.nWays[i].blockoffset);
-        invalidate(&icache, invalidAddress);
-        invalidate(&dcache, invalidAddress);
+        index);
+        l1Invalidations += invalidate_range(&icache, invalidAddress, l2cacheBlocksize);
+        l1Invalidations += invalidate_range(&dcache, invalidAddress, l2cacheBlocksize);
       }
 
-      // update the cache
-      update_lru(&l2cache.sets[index], i, l2cacheAssoc);
-      l2cache.sets[index].nWays[i].tag = tag;
-      l2cache.sets[index].nWays[i].blockoffset = blockoffset;
-      l2cache.sets[index].nWays[i].index = index;
-      l2cache.sets[index].nWays[i].validBit = 1; 
-
-      int l2cachePenalty = memspeed;
+      int l2cachePenalty = fetch_line(&l2cache, addr);
       l2cachePenalties += l2cachePenalty;
+
+      // update the cache
+      fill_way(&l2cache, index, i, tag);
       return l2cachePenalty + l2cacheHitTime;
     }
   } 
 
-  int l2cachePenalty = memspeed;
+  int l2cachePenalty = fetch_line(&l2cache, addr);
   l2cachePenalties += l2cachePenalty;
   return l2cachePenalty + l2cacheHitTime;
 }
+
+//------------------------------------//
+//       L1-Filtered Trace Functions  //
+//------------------------------------//
+
+// Start writing the stream of requests that reach the L2 to 'file'
+//
+// Returns True if Successful
+//
+int
+filter_open(const char *file)
+{
+  filterOut = fopen(file, "wb");
+  if (!filterOut) {
+    fprintf(stderr,"Unable to open L2 trace '%s' for writing\n", file);
+    return 0;
+  }
+
+  // Leave room for the header, written once the totals are known
+  struct filter_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  filterRecords = 0;
+  return fwrite(&hdr, sizeof(hdr), 1, filterOut) == 1;
+}
+
+// Run one reference through the L1s, recording it if it reaches the L2
+//
+void
+filter_access(uint64_t addr, char i_or_d)
+{
+  filterRec.info = (i_or_d == 'D');
+  filterPending = FALSE;
+
+  if (i_or_d == 'I') {
+    icache_access(addr);
+  } else {
+    dcache_access(addr);
+  }
+
+  if (filterPending) {
+    uint32_t words[3] = { filterRec.addr, filterRec.info, filterRec.addr >> 32 };
+    fwrite(words, sizeof(uint32_t), addressSize > 32 ? 3 : 2, filterOut);
+    filterRecords++;
+  }
+}
+
+// Finish the L2 trace, recording the L1 statistics and the 'totalRefs'
+// references it was filtered from
+// Returns the number of L2 requests written, or -1 on failure
+//
+int64_t
+filter_close(uint64_t totalRefs)
+{
+  struct filter_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, FILTER_MAGIC, sizeof(hdr.magic));
+  hdr.version      = FILTER_VERSION;
+  hdr.addressSize  = addressSize;
+  hdr.blocksize    = blocksize;
+  hdr.icacheSets   = icacheSets;
+  hdr.icacheAssoc  = icacheAssoc;
+  hdr.dcacheSets   = dcacheSets;
+  hdr.dcacheAssoc  = dcacheAssoc;
+  hdr.icacheBlocksize  = icacheBlocksize;
+  hdr.icacheSectorsize = icacheSectorsize;
+  hdr.dcacheBlocksize  = dcacheBlocksize;
+  hdr.dcacheSectorsize = dcacheSectorsize;
+  hdr.totalRefs    = totalRefs;
+  hdr.icacheRefs   = icacheRefs;
+  hdr.icacheMisses = icacheMisses;
+  hdr.dcacheRefs   = dcacheRefs;
+  hdr.dcacheMisses = dcacheMisses;
+  hdr.icacheSectorMisses = icacheSectorMisses;
+  hdr.dcacheSectorMisses = dcacheSectorMisses;
+  hdr.numRecords   = filterRecords;
+
+  int ok = !ferror(filterOut) && fseek(filterOut, 0, SEEK_SET) == 0 &&
+           fwrite(&hdr, sizeof(hdr), 1, filterOut) == 1;
+  ok = (fclose(filterOut) == 0) && ok;
+  filterOut = NULL;
+
+  return ok ? (int64_t)filterRecords : -1;
+}
+
+// Drive the L2 with the requests of the L1-filtered trace 'file'. The L1
+// statistics are taken from the trace and the L1 penalties are rebuilt from
+// the L2 access times. The L1s only track which lines they hold, so that
+// inclusive back-invalidations can be detected; if any hit an L1 line the
+// L1 miss stream of a full simulation would have differed, and a warning
+// is printed. The totals for the whole trace are returned in 'totalRefs'
+// and 'totalPenalties'
+//
+// Returns True if Successful
+//
+int
+replay_trace(const char *file, uint64_t *totalRefs, uint64_t *totalPenalties)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr,"Unable to open L2 trace '%s'\n", file);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct filter_header)) {
+    fprintf(stderr,"L2 trace '%s' is truncated\n", file);
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"Unable to map L2 trace '%s'\n", file);
+    return 0;
+  }
+
+  struct filter_header *hdr = map;
+  int recWords = hdr->addressSize > 32 ? 3 : 2;
+  if (memcmp(hdr->magic, FILTER_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != FILTER_VERSION ||
+      st.st_size != sizeof(*hdr) + hdr->numRecords * recWords * sizeof(uint32_t)) {
+    fprintf(stderr,"'%s' is not a valid L2 trace\n", file);
+    munmap(map, st.st_size);
+    return 0;
+  }
+  if (hdr->blocksize != blocksize ||
+      hdr->icacheSets != icacheSets || hdr->icacheAssoc != icacheAssoc ||
+      hdr->dcacheSets != dcacheSets || hdr->dcacheAssoc != dcacheAssoc ||
+      hdr->icacheBlocksize != icacheBlocksize ||
+      hdr->icacheSectorsize != icacheSectorsize ||
+      hdr->dcacheBlocksize != dcacheBlocksize ||
+      hdr->dcacheSectorsize != dcacheSectorsize) {
+    fprintf(stderr,"L2 trace '%s' was filtered with different L1s\n", file);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  icacheRefs   = hdr->icacheRefs;
+  icacheMisses = hdr->icacheMisses;
+  dcacheRefs   = hdr->dcacheRefs;
+  dcacheMisses = hdr->dcacheMisses;
+  icacheSectorMisses = hdr->icacheSectorMisses;
+  dcacheSectorMisses = hdr->dcacheSectorMisses;
+  l1Invalidations = 0;
+
+  // Every L1 hit costs just the hit time
+  uint64_t penalties = (icacheRefs - icacheMisses) * icacheHitTime +
+                       (dcacheRefs - dcacheMisses) * dcacheHitTime;
+
+  uint32_t *words = (uint32_t *)(hdr + 1);
+  for (uint64_t n = 0; n < hdr->numRecords; n++, words += recWords) {
+    struct filter_rec r = { words[0], words[1] };
+    struct filter_rec *rec = &r;
+    if (recWords > 2)
+      rec->addr |= (uint64_t)words[2] << 32;
+
+    uint32_t time = l2cache_access(rec->addr);
+
+    // Every request but those of an uninstantiated L1 is a miss of the L1,
+    // whether it filled a line or only a sector of one
+    if (attributeMisses && ((rec->info & 1) ? dcacheSets : icacheSets))
+      attribute_miss((rec->info & 1) ? DCACHE : ICACHE, rec->addr, time);
+
+    if (rec->info & 1) {
+      if (dcacheSets > 0) {
+        dcachePenalties += time;
+        time += dcacheHitTime;
+      }
+    } else if (icacheSets > 0) {
+      icachePenalties += time;
+      time += icacheHitTime;
+    }
+    penalties += time;
+
+    // Track the line the L1 was filled with
+    if (rec->info >> 1) {
+      struct cache *l1 = (rec->info & 1) ? &dcache : &icache;
+      uint32_t index = parse_address(rec->addr, l1->tagBits, l1->offsetBits);
+      struct way *way = &l1->sets[index].nWays[(rec->info >> 1) - 1];
+      way->tag = parse_address(rec->addr, 0, l1->indexBits + l1->offsetBits);
+      way->validBit = 1;
+    }
+  }
+
+  // Lines invalidated in the L1s may have been missed on again in the full
+  // simulation, which the trace doesn't hold
+  if (l1Invalidations > 0) {
+    replayInexact = TRUE;
+    fprintf(stderr,"Warning: %lu inclusive back-invalidations hit lines held "
+            "in the L1s, L1 results may differ from a full simulation\n",
+            l1Invalidations);
+  }
+
+  *totalRefs = hdr->totalRefs;
+  *totalPenalties = penalties;
+  munmap(map, st.st_size);
+  return 1;
+}
@@ -26,63 +26,161 @@ extern const char *email;
 #define TRUE 1
 #define FALSE 0
 
+// Levels of the memory hierarchy
+#define ICACHE  0
+#define DCACHE  1
+#define L2CACHE 2
+
+// The configuration, statistics and caches of the simulator are kept per
+// thread (__thread), so that the server can simulate a hierarchy on each of
+// its threads at once
+
 //------------------------------------//
 //        Cache Configuration         //
 //------------------------------------//
 
-extern uint32_t icacheSets;     // Number of sets in the I$
-extern uint32_t icacheAssoc;    // Associativity of the I$
-extern uint32_t icacheHitTime;  // Hit Time of the I$
+extern __thread uint32_t icacheSets;     // Number of sets in the I$
+extern __thread uint32_t icacheAssoc;    // Associativity of the I$
+extern __thread uint32_t icacheHitTime;  // Hit Time of the I$
+
+extern __thread uint32_t dcacheSets;     // Number of sets in the D$
+extern __thread uint32_t dcacheAssoc;    // Associativity of the D$
+extern __thread uint32_t dcacheHitTime;  // Hit Time of the D$
+
+extern __thread uint32_t l2cacheSets;    // Number of sets in the L2$
+extern __thread uint32_t l2cacheAssoc;   // Associativity of the L2$
+extern __thread uint32_t l2cacheHitTime; // Hit Time of the L2$
+extern __thread uint32_t inclusive;      // Indicates if the L2 is inclusive
 
-extern uint32_t dcacheSets;     // Number of sets in the D$
-extern uint32_t dcacheAssoc;    // Associativity of the D$
-extern uint32_t dcacheHitTime;  // Hit Time of the D$
+extern __thread uint32_t icacheBlocksize;  // Block/Line size of the I$
+extern __thread uint32_t icacheSectorsize; // Sector size of the I$
+extern __thread uint32_t dcacheBlocksize;  // Block/Line size of the D$
+extern __thread uint32_t dcacheSectorsize; // Sector size of the D$
+extern __thread uint32_t l2cacheBlocksize; // Block/Line size of the L2$
+extern __thread uint32_t l2cacheSectorsize;// Sector size of the L2$
 
-extern uint32_t l2cacheSets;    // Number of sets in the L2$
-extern uint32_t l2cacheAssoc;   // Associativity of the L2$
-extern uint32_t l2cacheHitTime; // Hit Time of the L2$
-extern uint32_t inclusive;      // Indicates if the L2 is inclusive
+extern __thread uint32_t blocksize;      // Block/Line size
+extern __thread uint32_t addressSize;    // Width of the trace addresses in bits
+extern __thread uint32_t memspeed;       // Latency of Main Memory
 
-extern uint32_t blocksize;      // Block/Line size
-extern uint32_t memspeed;       // Latency of Main Memory
+// Kinds of buffer that can sit behind a cache
+#define BUFFER_NONE   0
+#define BUFFER_VICTIM 1  // Holds the lines evicted from the cache
+#define BUFFER_MISS   2  // Holds the lines most recently missed on
+
+extern __thread uint32_t bufferKind[3];    // Kind of buffer behind each cache
+extern __thread uint32_t bufferEntries[3]; // Number of entries in the buffer
+extern __thread uint32_t bufferHitTime[3]; // Hit Time of the buffer
 
 //------------------------------------//
 //          Cache Statistics          //
 //------------------------------------//
 
-extern uint64_t icacheRefs;       // I$ references
-extern uint64_t icacheMisses;     // I$ misses
-extern uint64_t icachePenalties;  // I$ penalties
+extern __thread uint64_t icacheRefs;       // I$ references
+extern __thread uint64_t icacheMisses;     // I$ misses
+extern __thread uint64_t icachePenalties;  // I$ penalties
+
+extern __thread uint64_t dcacheRefs;       // D$ references
+extern __thread uint64_t dcacheMisses;     // D$ misses
+extern __thread uint64_t dcachePenalties;  // D$ penalties
+
+extern __thread uint64_t l2cacheRefs;      // L2$ references
+extern __thread uint64_t l2cacheMisses;    // L2$ misses
+extern __thread uint64_t l2cachePenalties; // L2$ penalties
+
+extern __thread uint64_t icacheSectorMisses;  // I$ misses on a valid line missing the sector
+extern __thread uint64_t dcacheSectorMisses;  // D$ misses on a valid line missing the sector
+extern __thread uint64_t l2cacheSectorMisses; // L2$ misses on a valid line missing the sector
+extern __thread uint64_t memoryBytes;         // Bytes fetched from main memory
 
-extern uint64_t dcacheRefs;       // D$ references
-extern uint64_t dcacheMisses;     // D$ misses
-extern uint64_t dcachePenalties;  // D$ penalties
+extern __thread uint64_t l1Invalidations; // Inclusive invalidations that hit an L1 line
+extern __thread int      replayInexact;   // Indicates the L1 statistics of a
+                                          // replay may differ from a full run
 
-extern uint64_t l2cacheRefs;      // L2$ references
-extern uint64_t l2cacheMisses;    // L2$ misses
-extern uint64_t l2cachePenalties; // L2$ penalties
+extern __thread uint64_t bufferProbes[3];  // Buffer probes (misses of the cache)
+extern __thread uint64_t bufferHits[3];    // Buffer hits
+extern __thread uint64_t bufferSwaps[3];   // Victim buffer hits that swapped a line back
+
+//------------------------------------//
+//          Checkpoint State          //
+//------------------------------------//
+
+// Progress through the trace, saved alongside the cache contents so that a
+// restored simulation can pick up where the checkpoint was taken
+//
+struct trace_state {
+  uint64_t traceRefs;      // References consumed from the trace
+  int64_t  traceOffset;    // Byte offset into the trace, -1 if not seekable
+  uint64_t totalRefs;      // Total Memory accesses so far
+  uint64_t totalPenalties; // Total Memory penalties so far
+};
 
 //------------------------------------//
 //      Cache Function Prototypes     //
 //------------------------------------//
 
 // Initialize the predictor
+// Returns True if Successful, False if the caches couldn't be allocated
+//
+int init_cache();
+
+// Free the data structures of the caches
+//
+void free_cache();
+
+// Zero all of the cache statistics
+//
+void reset_cache_stats();
+
+// Save the contents and statistics of every cache, along with the trace
+// state 'ts', to the checkpoint file 'file'
+// Returns True if Successful
+//
+int checkpoint_cache(const char *file, struct trace_state *ts);
+
+// Restore the contents and statistics of every cache from the checkpoint
+// file 'file' and return the saved trace state in 'ts'. The hit times and
+// memory latency may only differ from those of the checkpoint if the
+// statistics are to be reset ('resetStats')
+// Returns True if Successful
+//
+int restore_cache(const char *file, struct trace_state *ts, int resetStats);
+
+// Start recording the stream of requests that reach the L2 to the
+// L1-filtered trace 'file'. While recording, the L2 itself is not simulated
+// Returns True if Successful
+//
+int filter_open(const char *file);
+
+// Run the reference 'addr' through the I$ ('I') or D$ ('D') while recording
+// an L1-filtered trace
+//
+void filter_access(uint64_t addr, char i_or_d);
+
+// Finish the L1-filtered trace, which was filtered from 'totalRefs' references
+// Returns the number of L2 requests written, or -1 on failure
+//
+int64_t filter_close(uint64_t totalRefs);
+
+// Drive the L2 from the L1-filtered trace 'file' and return the totals for
+// the whole original trace in 'totalRefs' and 'totalPenalties'
+// Returns True if Successful
 //
-void init_cache();
+int replay_trace(const char *file, uint64_t *totalRefs, uint64_t *totalPenalties);
 
 // Perform a memory access through the icache interface for the address 'addr'
 // Return the access time for the memory operation
 //
-uint32_t icache_access(uint32_t addr);
+uint32_t icache_access(uint64_t addr);
 
 // Perform a memory access through the dcache interface for the address 'addr'
 // Return the access time for the memory operation
 //
-uint32_t dcache_access(uint32_t addr);
+uint32_t dcache_access(uint64_t addr);
 
 // Perform a memory access to the l2cache for the address 'addr'
 // Return the access time for the memory operation
 //
-uint32_t l2cache_access(uint32_t addr);
+uint32_t l2cache_access(uint64_t addr);
 
 #endif
@@ -8,11 +8,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "cache.h"
+#include "attrib.h"
+#include "synth.h"
+#include "stats.h"
 
-FILE *stream;
-char *buf = NULL;
-size_t len = 0;
+// Like the state of the simulator, the options are kept per thread so that
+// each request to the server can set its own
+//
+__thread FILE *stream;
+__thread char *buf = NULL;
+__thread size_t len = 0;
+
+__thread uint64_t checkpointAt; // Take a checkpoint after this many references
+__thread char *checkpointFile;  // Where to write the checkpoint, NULL for none
+__thread char *restoreFile;     // Checkpoint to restore from, NULL for none
+__thread int resetStats;        // Zero the statistics after restoring
+
+__thread char *filterFile;      // Write the L1-filtered L2 trace here, NULL for none
+__thread char *replayFile;      // L1-filtered L2 trace to replay, NULL for none
+
+__thread char *regionMapFile;   // Named address ranges to attribute misses to
+
+__thread char *profileFile;     // Write a workload profile here, NULL for none
+__thread char *synthFile;       // Profile to generate the trace from, NULL for none
+
+__thread char *serveSocket;     // Serve requests on this Unix socket, NULL for none
+__thread uint32_t serveThreads; // Threads simulating requests, 0 for one per CPU
+
+// The server decodes the trace once and shares it with all of its threads
+//
+char **serveArgs;               // Options of the server applied to every request
+int serveArgc;
+uint64_t *traceAddrs;           // Addresses of the decoded trace
+uint64_t *traceData;            // Bit set of the references to the D$
+uint64_t traceLength;
 
 // Print out the Usage information to stderr
 //
@@ -26,9 +63,62 @@ usage()
   fprintf(stderr," --icache=sets:assoc:hit    I-cache Parameters\n");
   fprintf(stderr," --dcache=sets:assoc:hit    D-cache Parameters\n");
   fprintf(stderr," --l2cache=sets:assoc:hit   L2-cache Parameters\n");
+  fprintf(stderr,"                            Any cache may add :blocksize or\n");
+  fprintf(stderr,"                            :blocksize:sectorsize\n");
   fprintf(stderr," --inclusive                Makes L2-cache be inclusive\n");
   fprintf(stderr," --blocksize=size           Block/Line size\n");
   fprintf(stderr," --memspeed=latency         Latency to Main Memory\n");
+  fprintf(stderr," --addrsize=bits            Width of the trace addresses (32)\n");
+  fprintf(stderr," --victim=cache:entries:hit Victim buffer behind the icache,\n");
+  fprintf(stderr,"                            dcache or l2cache\n");
+  fprintf(stderr," --misscache=cache:entries:hit\n");
+  fprintf(stderr,"                            Miss cache behind the icache,\n");
+  fprintf(stderr,"                            dcache or l2cache\n");
+  fprintf(stderr," --checkpoint-at=N:file     Save the simulator state to file\n");
+  fprintf(stderr,"                            after N trace references\n");
+  fprintf(stderr," --restore=file             Resume from a saved checkpoint\n");
+  fprintf(stderr," --reset-stats              Zero the statistics on restore\n");
+  fprintf(stderr," --l2-trace=file            Only simulate the L1s, writing the\n");
+  fprintf(stderr,"                            requests that reach the L2 to file\n");
+  fprintf(stderr," --replay=file              Drive the L2 from an L2 trace\n");
+  fprintf(stderr," --attribute=size           Attribute misses to regions of size bytes\n");
+  fprintf(stderr," --attribute-map=file       Attribute misses to the named address\n");
+  fprintf(stderr,"                            ranges in file ('start end name')\n");
+  fprintf(stderr," --topk=K                   Number of regions reported per cache\n");
+  fprintf(stderr," --profile=file             Write a workload profile of the trace\n");
+  fprintf(stderr," --phase=N                  References per profile phase\n");
+  fprintf(stderr," --synth=file               Simulate a synthetic trace generated\n");
+  fprintf(stderr,"                            from a profile instead of a trace\n");
+  fprintf(stderr," --format=text|json|csv     Format of the statistics\n");
+  fprintf(stderr," --serve=socket             Decode the trace once and answer\n");
+  fprintf(stderr,"                            requests on a Unix socket\n");
+  fprintf(stderr," --threads=N                Threads of the server (one per CPU)\n");
+}
+
+// Attach a victim buffer or miss cache of 'kind' as described by 'spec'
+// (cache:entries:hit) to one of the caches
+//
+// Returns True if Successful
+//
+int
+handle_buffer(char *spec, uint32_t kind)
+{
+  const char *names[] = { "icache", "dcache", "l2cache" };
+  char name[16];
+  uint32_t entries, hitTime;
+
+  if (sscanf(spec,"%15[^:]:%u:%u", name, &entries, &hitTime) != 3 || !entries)
+    return 0;
+
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    if (!strcmp(name, names[level])) {
+      bufferKind[level]    = kind;
+      bufferEntries[level] = entries;
+      bufferHitTime[level] = hitTime;
+      return 1;
+    }
+  }
+  return 0;
 }
 
 // Process an option and update the cache
@@ -40,17 +130,70 @@ int
 handle_option(char *arg)
 {
   if (!strncmp(arg,"--icache=",9)) {
-    sscanf(arg+9,"%u:%u:%u", &icacheSets, &icacheAssoc, &icacheHitTime);
+    icacheBlocksize = icacheSectorsize = 0;
+    sscanf(arg+9,"%u:%u:%u:%u:%u", &icacheSets, &icacheAssoc, &icacheHitTime,
+        &icacheBlocksize, &icacheSectorsize);
   } else if (!strncmp(arg,"--dcache=",9)) {
-    sscanf(arg+9,"%u:%u:%u", &dcacheSets, &dcacheAssoc, &dcacheHitTime);
+    dcacheBlocksize = dcacheSectorsize = 0;
+    sscanf(arg+9,"%u:%u:%u:%u:%u", &dcacheSets, &dcacheAssoc, &dcacheHitTime,
+        &dcacheBlocksize, &dcacheSectorsize);
   } else if (!strncmp(arg,"--l2cache=",10)) {
-    sscanf(arg+10,"%u:%u:%u", &l2cacheSets, &l2cacheAssoc, &l2cacheHitTime);
+    l2cacheBlocksize = l2cacheSectorsize = 0;
+    sscanf(arg+10,"%u:%u:%u:%u:%u", &l2cacheSets, &l2cacheAssoc, &l2cacheHitTime,
+        &l2cacheBlocksize, &l2cacheSectorsize);
   } else if (!strcmp(arg,"--inclusive")) {
     inclusive = TRUE;
   } else if (!strncmp(arg,"--blocksize=",12)) {
     sscanf(arg+12,"%u", &blocksize);
   } else if (!strncmp(arg,"--memspeed=",11)) {
     sscanf(arg+11,"%u", &memspeed);
+  } else if (!strncmp(arg,"--addrsize=",11)) {
+    sscanf(arg+11,"%u", &addressSize);
+    if (addressSize < 1 || addressSize > 64)
+      return 0;
+  } else if (!strncmp(arg,"--victim=",9)) {
+    return handle_buffer(arg+9, BUFFER_VICTIM);
+  } else if (!strncmp(arg,"--misscache=",12)) {
+    return handle_buffer(arg+12, BUFFER_MISS);
+  } else if (!strncmp(arg,"--checkpoint-at=",16)) {
+    int n = 0;
+    if (sscanf(arg+16,"%lu:%n", &checkpointAt, &n) != 1 || !n || !arg[16+n])
+      return 0;
+    checkpointFile = arg+16+n;
+  } else if (!strncmp(arg,"--restore=",10)) {
+    restoreFile = arg+10;
+  } else if (!strcmp(arg,"--reset-stats")) {
+    resetStats = TRUE;
+  } else if (!strncmp(arg,"--l2-trace=",11)) {
+    filterFile = arg+11;
+  } else if (!strncmp(arg,"--replay=",9)) {
+    replayFile = arg+9;
+  } else if (!strncmp(arg,"--attribute=",12)) {
+    sscanf(arg+12,"%u", &attributeRegion);
+    if (attributeRegion & (attributeRegion - 1))
+      return 0;
+  } else if (!strncmp(arg,"--attribute-map=",16)) {
+    regionMapFile = arg+16;
+  } else if (!strncmp(arg,"--topk=",7)) {
+    sscanf(arg+7,"%u", &attributeTopK);
+  } else if (!strncmp(arg,"--profile=",10)) {
+    profileFile = arg+10;
+  } else if (!strncmp(arg,"--phase=",8)) {
+    if (sscanf(arg+8,"%lu", &phaseLength) != 1 || !phaseLength)
+      return 0;
+  } else if (!strncmp(arg,"--synth=",8)) {
+    synthFile = arg+8;
+  } else if (!strcmp(arg,"--format=text")) {
+    outputFormat = FORMAT_TEXT;
+  } else if (!strcmp(arg,"--format=json")) {
+    outputFormat = FORMAT_JSON;
+  } else if (!strcmp(arg,"--format=csv")) {
+    outputFormat = FORMAT_CSV;
+  } else if (!strncmp(arg,"--serve=",8)) {
+    serveSocket = arg+8;
+  } else if (!strncmp(arg,"--threads=",10)) {
+    if (sscanf(arg+10,"%u", &serveThreads) != 1 || !serveThreads)
+      return 0;
   } else {
     return 0;
   }
@@ -66,6 +209,33 @@ printStudentInfo()
   printf("Student email:  %s\n", email);
 }
 
+// Print out the configuration of the buffer behind a cache, if any
+//
+void
+printBufferConfig(int level)
+{
+  if (bufferKind[level] == BUFFER_NONE)
+    return;
+
+  printf("    %s: %u entries, %u Cycles\n",
+      bufferKind[level] == BUFFER_VICTIM ? "Victim Buffer" : "Miss Cache",
+      bufferEntries[level], bufferHitTime[level]);
+}
+
+// Print out the block and sector sizes of a cache when they differ from
+// the global block size
+//
+void
+printBlockConfig(uint32_t block, uint32_t sector)
+{
+  if (block != blocksize) {
+    printf("    Block: %u Bytes\n", block);
+  }
+  if (sector != block) {
+    printf("    Sectors: %u x %u Bytes\n", block / sector, sector);
+  }
+}
+
 // Print out the memory hierarchy
 //
 void
@@ -75,32 +245,91 @@ printCacheConfig()
   // Print I$ Configuration
   if (icacheSets) {
     printf("  I$ Configuration:\n");
-    printf("    Size:  %u KB\n", icacheSets * icacheAssoc * blocksize / 1024);
+    printf("    Size:  %u KB\n", icacheSets * icacheAssoc * icacheBlocksize / 1024);
     printf("    Sets:  %u\n", icacheSets);
     printf("    Assoc: %u\n", icacheAssoc);
     printf("    Lat:   %u Cycles\n", icacheHitTime);
+    printBlockConfig(icacheBlocksize, icacheSectorsize);
+    printBufferConfig(ICACHE);
   }
   // Print D$ Configuration
   if (dcacheSets) {
     printf("  D$ Configuration:\n");
-    printf("    Size:  %u KB\n", dcacheSets * dcacheAssoc * blocksize / 1024);
+    printf("    Size:  %u KB\n", dcacheSets * dcacheAssoc * dcacheBlocksize / 1024);
     printf("    Sets:  %u\n", dcacheSets);
     printf("    Assoc: %u\n", dcacheAssoc);
     printf("    Lat:   %u Cycles\n", dcacheHitTime);
+    printBlockConfig(dcacheBlocksize, dcacheSectorsize);
+    printBufferConfig(DCACHE);
   }
   // Print L2$ Configuration
   if (l2cacheSets) {
     printf("  L2$ Configuration:\n");
-    printf("    Size:  %u KB\n", l2cacheSets * l2cacheAssoc * blocksize / 1024);
+    printf("    Size:  %u KB\n", l2cacheSets * l2cacheAssoc * l2cacheBlocksize / 1024);
     printf("    Sets:  %u\n", l2cacheSets);
     printf("    Assoc: %u\n", l2cacheAssoc);
     printf("    Lat:   %u Cycles\n", l2cacheHitTime);
     printf("    Inclusive: %s\n", inclusive ? "Yes" : "No");
+    printBlockConfig(l2cacheBlocksize, l2cacheSectorsize);
+    printBufferConfig(L2CACHE);
   }
   printf("  Block Size: %u Bytes\n", blocksize);
   printf("  Memspeed:   %u Cycles\n", memspeed);
 }
 
+// Print out the statistics of the buffer behind a cache, if any
+//
+void
+printBufferStats(const char *name, int level)
+{
+  if (bufferKind[level] == BUFFER_NONE)
+    return;
+
+  printf("  %s %s:\n", name,
+      bufferKind[level] == BUFFER_VICTIM ? "victim buffer" : "miss cache");
+  printf("    probes:     %10lu\n", bufferProbes[level]);
+  printf("    hits:       %10lu\n", bufferHits[level]);
+  if (bufferKind[level] == BUFFER_VICTIM) {
+    printf("    swaps:      %10lu\n", bufferSwaps[level]);
+  }
+  if (bufferProbes[level] > 0) {
+    printf("    hit rate:   %9.2f%%\n",
+        100.0*(double)bufferHits[level]/(double)bufferProbes[level]);
+  } else {
+    printf("    hit rate:            -\n");
+  }
+  printf("    hit cycles: %10lu\n", bufferHits[level] * bufferHitTime[level]);
+}
+
+// Print out how the misses of a sectored cache split between misses on
+// lines that weren't there and misses on sectors of lines that were
+//
+void
+printSectorStats(const char *name, uint32_t block, uint32_t sector,
+                 uint64_t misses, uint64_t sectorMisses)
+{
+  if (sector == block)
+    return;
+
+  printf("  %s sectors:\n", name);
+  printf("    line misses:    %10lu\n", misses - sectorMisses);
+  printf("    sector misses:  %10lu\n", sectorMisses);
+}
+
+// Indicates if any cache has its own block size or is sectored, in which
+// case the traffic to main memory is reported too
+//
+int
+hasBlockConfig()
+{
+  return (icacheSets && (icacheBlocksize != blocksize ||
+                         icacheSectorsize != icacheBlocksize)) ||
+         (dcacheSets && (dcacheBlocksize != blocksize ||
+                         dcacheSectorsize != dcacheBlocksize)) ||
+         (l2cacheSets && (l2cacheBlocksize != blocksize ||
+                          l2cacheSectorsize != l2cacheBlocksize));
+}
+
 // Print out the Cache Statistics
 //
 void
@@ -120,6 +349,9 @@ printCacheStats()
       printf("  I-cache miss rate:                -\n");
       printf("  avg I-cache access time:          -\n");
     }
+    printSectorStats("I-cache", icacheBlocksize, icacheSectorsize,
+        icacheMisses, icacheSectorMisses);
+    printBufferStats("I-cache", ICACHE);
   }
   if (dcacheSets) {
     printf("  total D-cache accesses:  %10lu\n", dcacheRefs);
@@ -134,6 +366,9 @@ printCacheStats()
       printf("  D-cache miss rate:                -\n");
       printf("  avg D-cache access time:          -\n");
     }
+    printSectorStats("D-cache", dcacheBlocksize, dcacheSectorsize,
+        dcacheMisses, dcacheSectorMisses);
+    printBufferStats("D-cache", DCACHE);
   }
   if (l2cacheSets) {
     printf("  total L2-cache accesses: %10lu\n", l2cacheRefs);
@@ -149,6 +384,9 @@ printCacheStats()
       printf("  L2-cache miss rate:               -\n");
       printf("  avg L2-cache access time:         -\n");
     }
+    printSectorStats("L2-cache", l2cacheBlocksize, l2cacheSectorsize,
+        l2cacheMisses, l2cacheSectorMisses);
+    printBufferStats("L2-cache", L2CACHE);
   }
 }
 
@@ -173,6 +411,148 @@ set_defaults()
   inclusive       = 0;
   blocksize       = 16;
   memspeed        = 50;
+  icacheBlocksize   = 0;
+  icacheSectorsize  = 0;
+  dcacheBlocksize   = 0;
+  dcacheSectorsize  = 0;
+  l2cacheBlocksize  = 0;
+  l2cacheSectorsize = 0;
+  addressSize     = 32;
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    bufferKind[level]    = BUFFER_NONE;
+    bufferEntries[level] = 0;
+    bufferHitTime[level] = 0;
+  }
+
+  // Set default Checkpoint Parameters
+  checkpointAt    = 0;
+  checkpointFile  = NULL;
+  restoreFile     = NULL;
+  resetStats      = FALSE;
+
+  // Set default L2 trace Parameters
+  filterFile      = NULL;
+  replayFile      = NULL;
+
+  // Set default Attribution Parameters
+  attributeRegion = 0;
+  attributeTopK   = 10;
+  regionMapFile   = NULL;
+
+  // Set default Profile Parameters
+  profileFile     = NULL;
+  phaseLength     = 1000000;
+  synthFile       = NULL;
+
+  // Set default Output and Server Parameters
+  outputFormat    = FORMAT_TEXT;
+  serveSocket     = NULL;
+  serveThreads    = 0;
+}
+
+// Skip the part of the trace already simulated by a restored checkpoint,
+// seeking straight to it when the trace is a regular file
+//
+// Returns True if Successful
+//
+int
+skip_trace(struct trace_state *ts)
+{
+  if (ts->traceOffset >= 0 && fseek(stream, ts->traceOffset, SEEK_SET) == 0) {
+    return 1;
+  }
+
+  for (uint64_t i = 0; i < ts->traceRefs; i++) {
+    if (getline(&buf, &len, stream) == -1) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Save a checkpoint of the current simulator state, exiting on failure
+//
+void
+take_checkpoint(uint64_t traceRefs, uint64_t totalRefs, uint64_t totalPenalties)
+{
+  struct trace_state ts;
+  ts.traceRefs      = traceRefs;
+  ts.traceOffset    = ftell(stream);
+  ts.totalRefs      = totalRefs;
+  ts.totalPenalties = totalPenalties;
+
+  if (!checkpoint_cache(checkpointFile, &ts)) {
+    exit(1);
+  }
+}
+
+// Indicates if 'n' is a power of two
+//
+int
+is_pow2(uint32_t n)
+{
+  return n && !(n & (n - 1));
+}
+
+// Largest number of ways, buffer entries included, of a hierarchy, which
+// keeps its caches to a few hundred MB
+//
+#define MAX_WAYS (1 << 24)
+
+// Fill in the block and sector size of the caches that weren't given their
+// own, and check that the hierarchy can be simulated
+//
+// Returns NULL if Successful, otherwise the reason it can't
+//
+const char *
+validate_config()
+{
+  uint32_t *sizes[3][2] = {
+    { &icacheBlocksize, &icacheSectorsize },
+    { &dcacheBlocksize, &dcacheSectorsize },
+    { &l2cacheBlocksize, &l2cacheSectorsize },
+  };
+  const uint32_t sets[] = { icacheSets, dcacheSets, l2cacheSets };
+  const uint32_t assocs[] = { icacheAssoc, dcacheAssoc, l2cacheAssoc };
+  uint64_t ways = 0;
+
+  for (int level = ICACHE; level <= L2CACHE; level++) {
+    uint32_t *block = sizes[level][0], *sector = sizes[level][1];
+    if (!*block)
+      *block = blocksize;
+    if (!*sector)
+      *sector = *block;
+
+    if (!sets[level]) {
+      if (bufferKind[level] != BUFFER_NONE)
+        return "Buffers can't be attached to uninstantiated caches";
+      continue;
+    }
+    if (!is_pow2(sets[level]))
+      return "The number of sets must be a power of two";
+    if (!assocs[level])
+      return "An instantiated cache needs at least one way";
+    ways += (uint64_t)sets[level] * assocs[level];
+    if (bufferKind[level] != BUFFER_NONE)
+      ways += bufferEntries[level];
+    if (!is_pow2(*block) || !is_pow2(*sector))
+      return "Block and sector sizes must be powers of two";
+    if (*sector > *block || *block / *sector > 32)
+      return "A block must hold between 1 and 32 sectors";
+  }
+
+  if (ways > MAX_WAYS)
+    return "A hierarchy can't hold more than 16M ways";
+
+  // An L1 line must fit in an L2 line, and an L1 fill in an L2 sector
+  for (int level = ICACHE; level <= DCACHE; level++) {
+    if (sets[level] && sets[L2CACHE] &&
+        (*sizes[level][0] > l2cacheBlocksize ||
+         *sizes[level][1] > l2cacheSectorsize))
+      return "L1 blocks and sectors can't be larger than those of the L2";
+  }
+
+  return NULL;
 }
 
 // Reads a line from the input stream and extracts the
@@ -181,17 +561,310 @@ set_defaults()
 // Returns True if Successful 
 //
 int
-read_mem_access(uint32_t *addr, char *i_or_d)
+read_mem_access(uint64_t *addr, char *i_or_d)
 {
   if (getline(&buf, &len, stream) == -1) {
     return 0;
   }
 
-  sscanf(buf,"0x%x %c\n",addr,i_or_d);
+  sscanf(buf,"0x%lx %c\n",addr,i_or_d);
+
+  if (addressSize < 64 && (*addr >> addressSize)) {
+    fprintf(stderr,"Input Error address 0x%lx is wider than %u bits, "
+            "use --addrsize\n", *addr, addressSize);
+    exit(1);
+  }
 
   return 1;
 }
 
+// Fetches the next memory access, from the synthetic trace when one is
+// being generated or else from the input stream, and adds it to the
+// workload profile
+//
+// Returns True if Successful
+//
+int
+next_mem_access(uint64_t *addr, char *i_or_d)
+{
+  int ok = synthFile ? synth_next(addr, i_or_d) : read_mem_access(addr, i_or_d);
+  if (ok && profileFile) {
+    profile_access(*addr, *i_or_d);
+  }
+  return ok;
+}
+
+// Run the whole trace through the L1s only, writing the requests that
+// reach the L2 to the L1-filtered trace
+//
+void
+filter_trace()
+{
+  uint64_t totalRefs = 0;
+  uint64_t addr = 0;
+  char i_or_d = '\0';
+
+  if (!filter_open(filterFile)) {
+    exit(1);
+  }
+
+  while (next_mem_access(&addr, &i_or_d)) {
+    totalRefs++;
+    if (i_or_d != 'I' && i_or_d != 'D') {
+      fprintf(stderr,"Input Error '%c' must be either 'I' or 'D'\n", i_or_d);
+      exit(1);
+    }
+    filter_access(addr, i_or_d);
+  }
+
+  int64_t requests = filter_close(totalRefs);
+  if (requests < 0) {
+    fprintf(stderr,"Error writing L2 trace '%s'\n", filterFile);
+    exit(1);
+  }
+
+  printf("L2 trace written to %s\n", filterFile);
+  printf("  Total Memory accesses:  %lu\n", totalRefs);
+  printf("  L2 requests:            %lu\n", requests);
+  if (totalRefs > 0) {
+    printf("  L2 request rate: %19.2f%%\n", 100.0*(double)requests/totalRefs);
+  }
+}
+
+// Write out the workload profile, exiting on failure
+//
+void
+finish_profile()
+{
+  int64_t phases = profile_close();
+  if (phases < 0) {
+    fprintf(stderr,"Error writing profile '%s'\n", profileFile);
+    exit(1);
+  }
+
+  if (outputFormat == FORMAT_TEXT) {
+    printf("Workload profile written to %s\n", profileFile);
+    printf("  Phases:                 %lu\n", phases);
+  }
+}
+
+// Indicates if only the hierarchy and the output format are configured,
+// which is all that the server and its requests can set
+//
+int
+hierarchy_only()
+{
+  return !checkpointFile && !restoreFile && !filterFile && !replayFile &&
+         !attributeRegion && !regionMapFile && !profileFile && !synthFile;
+}
+
+// Decode the whole trace into memory for the server
+//
+void
+decode_trace()
+{
+  uint64_t cap = 1 << 20;
+  uint64_t addr = 0;
+  char i_or_d = '\0';
+
+  traceAddrs = malloc(cap * sizeof(uint64_t));
+  traceData = calloc(cap / 64, sizeof(uint64_t));
+  traceLength = 0;
+  while (read_mem_access(&addr, &i_or_d)) {
+    if (i_or_d != 'I' && i_or_d != 'D') {
+      fprintf(stderr,"Input Error '%c' must be either 'I' or 'D'\n", i_or_d);
+      exit(1);
+    }
+    if (traceLength == cap) {
+      cap *= 2;
+      traceAddrs = realloc(traceAddrs, cap * sizeof(uint64_t));
+      traceData = realloc(traceData, cap / 64 * sizeof(uint64_t));
+      memset(traceData + cap / 128, 0, cap / 128 * sizeof(uint64_t));
+    }
+    traceAddrs[traceLength] = addr;
+    if (i_or_d == 'D') {
+      traceData[traceLength / 64] |= (uint64_t)1 << (traceLength % 64);
+    }
+    traceLength++;
+  }
+}
+
+// Answer a request to the server, a line holding the options of a hierarchy
+// on top of those of the server, with the statistics of the decoded trace
+// on that hierarchy
+//
+void
+serve_request(char *line, FILE *out)
+{
+  if (line[strspn(line, " \t\r\n")] == '\0')
+    return;
+
+  set_defaults();
+  for (int i = 0; i < serveArgc; i++) {
+    handle_option(serveArgs[i]);
+  }
+  if (outputFormat == FORMAT_TEXT) {
+    outputFormat = FORMAT_JSON;
+  }
+
+  char *save = NULL;
+  for (char *opt = strtok_r(line, " \t\r\n", &save); opt;
+       opt = strtok_r(NULL, " \t\r\n", &save)) {
+    if (!handle_option(opt)) {
+      char message[256];
+      snprintf(message, sizeof(message), "Unrecognized option %s", opt);
+      printStatsError(out, message);
+      return;
+    }
+  }
+
+  const char *error = validate_config();
+  if (!error && (!hierarchy_only() || serveSocket || serveThreads)) {
+    error = "Requests can only set the hierarchy and the output format";
+  }
+  if (!error && outputFormat == FORMAT_TEXT) {
+    outputFormat = FORMAT_JSON;
+    error = "Requests are answered in json or csv";
+  }
+  if (error) {
+    printStatsError(out, error);
+    return;
+  }
+
+  if (!init_cache()) {
+    printStatsError(out, "Unable to allocate the caches");
+    return;
+  }
+  uint64_t totalPenalties = 0;
+  for (uint64_t i = 0; i < traceLength; i++) {
+    if (traceData[i / 64] >> (i % 64) & 1) {
+      totalPenalties += dcache_access(traceAddrs[i]);
+    } else {
+      totalPenalties += icache_access(traceAddrs[i]);
+    }
+  }
+  printStats(out, traceLength, totalPenalties);
+  free_cache();
+}
+
+// Connections accepted by the server, waiting for a thread
+//
+#define SERVE_QUEUE 64
+
+int serveQueue[SERVE_QUEUE];
+int queueHead = 0;
+int queueCount = 0;
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queueNotFull = PTHREAD_COND_INITIALIZER;
+
+// Thread of the server, answering the requests of one connection at a time
+//
+void *
+serve_worker(void *arg)
+{
+  for (;;) {
+    pthread_mutex_lock(&queueLock);
+    while (!queueCount) {
+      pthread_cond_wait(&queueNotEmpty, &queueLock);
+    }
+    int fd = serveQueue[queueHead];
+    queueHead = (queueHead + 1) % SERVE_QUEUE;
+    queueCount--;
+    pthread_cond_signal(&queueNotFull);
+    pthread_mutex_unlock(&queueLock);
+
+    FILE *in = fdopen(fd, "r");
+    int outFd = dup(fd);
+    FILE *out = (outFd < 0) ? NULL : fdopen(outFd, "w");
+    if (!in || !out) {
+      if (in) fclose(in); else close(fd);
+      if (out) fclose(out); else if (outFd >= 0) close(outFd);
+      continue;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, in) != -1) {
+      serve_request(line, out);
+      fflush(out);
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+  }
+  return NULL;
+}
+
+// Decode the trace and answer requests on the Unix socket until killed
+//
+void
+serve()
+{
+  decode_trace();
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(serveSocket) >= sizeof(addr.sun_path)) {
+    fprintf(stderr,"Socket path '%s' is too long\n", serveSocket);
+    exit(1);
+  }
+  strcpy(addr.sun_path, serveSocket);
+
+  // Replace the socket of an earlier server, but nothing else
+  struct stat st;
+  if (stat(serveSocket, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(serveSocket);
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, SOMAXCONN) < 0) {
+    fprintf(stderr,"Unable to listen on socket '%s'\n", serveSocket);
+    exit(1);
+  }
+
+  // A client hanging up shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!serveThreads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    serveThreads = (cpus > 0) ? cpus : 1;
+  }
+  for (uint32_t i = 0; i < serveThreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_worker, NULL) != 0) {
+      fprintf(stderr,"Unable to start the threads of the server\n");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+
+  printf("Serving %lu references on %s with %u threads\n", traceLength,
+      serveSocket, serveThreads);
+  fflush(stdout);
+
+  for (;;) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        perror("accept");
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&queueLock);
+    while (queueCount == SERVE_QUEUE) {
+      pthread_cond_wait(&queueNotFull, &queueLock);
+    }
+    serveQueue[(queueHead + queueCount) % SERVE_QUEUE] = fd;
+    queueCount++;
+    pthread_cond_signal(&queueNotEmpty);
+    pthread_mutex_unlock(&queueLock);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -199,6 +872,8 @@ main(int argc, char *argv[])
   set_defaults();
 
   // Process cmdline Arguments
+  serveArgs = malloc(argc * sizeof(char *));
+  serveArgc = 0;
   for (int i = 1; i < argc; ++i) {
     if (!strcmp(argv[i],"--help")) {
       usage();
@@ -209,22 +884,131 @@ main(int argc, char *argv[])
         usage();
         exit(1);
       }
+      if (strncmp(argv[i],"--serve=",8) && strncmp(argv[i],"--threads=",10)) {
+        serveArgs[serveArgc++] = argv[i];
+      }
     } else {
       // Use as input file
       stream = fopen(argv[i], "r");
     }
   }
 
+  if (!stream) {
+    fprintf(stderr,"Unable to open trace file\n");
+    exit(1);
+  }
+  const char *error = validate_config();
+  if (error) {
+    fprintf(stderr,"%s\n", error);
+    exit(1);
+  }
+  if ((filterFile || replayFile) && (bufferKind[ICACHE] || bufferKind[DCACHE])) {
+    fprintf(stderr,"L2 traces can't be used with buffers behind the L1s\n");
+    exit(1);
+  }
+  if ((filterFile || replayFile) && (checkpointFile || restoreFile)) {
+    fprintf(stderr,"L2 traces can't be combined with checkpoints\n");
+    exit(1);
+  }
+  if (synthFile && (checkpointFile || restoreFile || replayFile)) {
+    fprintf(stderr,"Synthetic traces can't be combined with checkpoints or replays\n");
+    exit(1);
+  }
+  if (profileFile && replayFile) {
+    fprintf(stderr,"Profiles can't be written while replaying an L2 trace\n");
+    exit(1);
+  }
+  if (outputFormat != FORMAT_TEXT && (filterFile || attributeRegion || regionMapFile)) {
+    fprintf(stderr,"L2 traces and miss attribution are only reported as text\n");
+    exit(1);
+  }
+
+  // Answer requests instead of simulating a single hierarchy
+  if (serveSocket) {
+    if (!hierarchy_only()) {
+      fprintf(stderr,"The server only takes the hierarchy and the output format\n");
+      exit(1);
+    }
+    serve();
+    return 0;
+  }
+
+  // Set up miss attribution
+  if (attributeRegion || regionMapFile) {
+    if (filterFile) {
+      fprintf(stderr,"Misses can't be attributed while writing an L2 trace\n");
+      exit(1);
+    }
+    if (regionMapFile && !load_region_map(regionMapFile)) {
+      exit(1);
+    }
+    init_attribution();
+  }
+
   // Initialize the cache
-  init_cache();
+  if (!init_cache()) {
+    fprintf(stderr,"Unable to allocate the caches\n");
+    exit(1);
+  }
 
+  // Set up the workload profile and the synthetic trace
+  if (profileFile && !profile_open(profileFile)) {
+    exit(1);
+  }
+  if (synthFile && !synth_open(synthFile)) {
+    exit(1);
+  }
+
+  if (filterFile) {
+    filter_trace();
+    if (profileFile) {
+      finish_profile();
+    }
+    fclose(stream);
+    free(buf);
+    return 0;
+  }
+
+  uint64_t traceRefs = 0;
   uint64_t totalRefs = 0;
   uint64_t totalPenalties = 0;
-  uint32_t addr = 0;
+  uint64_t addr = 0;
   char i_or_d = '\0';
 
+  // Replay an L1-filtered trace instead of reading the full one
+  if (replayFile) {
+    if (!replay_trace(replayFile, &totalRefs, &totalPenalties)) {
+      exit(1);
+    }
+  }
+
+  // Resume from a checkpoint
+  if (restoreFile) {
+    struct trace_state ts;
+    if (!restore_cache(restoreFile, &ts, resetStats)) {
+      exit(1);
+    }
+    if (!skip_trace(&ts)) {
+      fprintf(stderr,"Trace is shorter than checkpoint '%s'\n", restoreFile);
+      exit(1);
+    }
+    traceRefs = ts.traceRefs;
+    if (resetStats) {
+      reset_cache_stats();
+    } else {
+      totalRefs = ts.totalRefs;
+      totalPenalties = ts.totalPenalties;
+    }
+  }
+
+  uint64_t firstRef = traceRefs;
+  if (checkpointFile && traceRefs == checkpointAt) {
+    take_checkpoint(traceRefs, totalRefs, totalPenalties);
+  }
+
   // Read each memory access from the trace
-  while (read_mem_access(&addr, &i_or_d)) {
+  while (!replayFile && next_mem_access(&addr, &i_or_d)) {
+    traceRefs++;
     totalRefs++;
     // Direct the memory access to the appropriate cache
     if (i_or_d == 'I') {
@@ -235,20 +1019,54 @@ main(int argc, char *argv[])
       fprintf(stderr,"Input Error '%c' must be either 'I' or 'D'\n", i_or_d);
       exit(1);
     }
+
+    if (checkpointFile && traceRefs == checkpointAt) {
+      take_checkpoint(traceRefs, totalRefs, totalPenalties);
+    }
+  }
+
+  // The checkpoint may lie before the one restored or past the end
+  if (checkpointFile && (checkpointAt < firstRef || checkpointAt > traceRefs)) {
+    fprintf(stderr,"No checkpoint written to '%s': reference %lu isn't within "
+        "references %lu to %lu of the trace\n", checkpointFile, checkpointAt,
+        firstRef, traceRefs);
+    exit(1);
   }
 
   // Print out the statistics
+  if (outputFormat != FORMAT_TEXT) {
+    printStats(stdout, totalRefs, totalPenalties);
+    if (profileFile) {
+      finish_profile();
+    }
+    fclose(stream);
+    free(buf);
+    return 0;
+  }
   printStudentInfo();
   printCacheConfig();
   printCacheStats();
   printf("Total Memory accesses:  %lu\n", totalRefs);
   printf("Total Memory penalties: %lu\n", totalPenalties);
+  if (hasBlockConfig()) {
+    printf("Total Memory bytes:     %lu\n", memoryBytes);
+  }
   if (totalRefs > 0) {
     printf("avg Memory access time: %13.2f cycles\n",
         (double)totalPenalties / totalRefs);
   } else {
     printf("avg Memory access time:             -\n");
   }
+  if (replayInexact) {
+    printf("Inexact replay: %lu inclusive invalidations hit L1 lines\n",
+        l1Invalidations);
+  }
+  if (attributeMisses) {
+    printAttribution();
+  }
+  if (profileFile) {
+    finish_profile();
+  }
 
   // Cleanup
   fclose(stream);
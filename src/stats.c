@@ -0,0 +1,245 @@
+//========================================================//
+//  stats.c                                               //
+//  Source file for the machine readable output of the    //
+//  Cache Simulator                                       //
+//                                                        //
+//  The counters are gathered into a list of named        //
+//  fields, which is then written out as a JSON object    //
+//  or as CSV                                             //
+//========================================================//
+
+#include "stats.h"
+#include "cache.h"
+#include <string.h>
+
+//------------------------------------//
+//        Output Configuration        //
+//------------------------------------//
+
+__thread uint32_t outputFormat;  // Format the statistics are printed in
+
+//------------------------------------//
+//       Output Data Structures       //
+//------------------------------------//
+
+#define MAX_FIELDS 64
+
+#define FIELD_UINT 0
+#define FIELD_REAL 1
+#define FIELD_BOOL 2
+#define FIELD_STR  3
+
+// A named value of the output. Rates and averages are undefined (null in
+// JSON, empty in CSV) when nothing was counted
+//
+struct field {
+  char name[32];
+  int type;
+  int defined;
+  uint64_t u;
+  double d;
+  const char *s;
+};
+
+struct field_list {
+  struct field fields[MAX_FIELDS];
+  int n;
+};
+
+//------------------------------------//
+//          Helper Functions          //
+//------------------------------------//
+
+struct field *
+add_field(struct field_list *list, const char *prefix, const char *name,
+          int type) {
+  struct field *f = &list->fields[list->n++];
+  if (prefix) {
+    snprintf(f->name, sizeof(f->name), "%s_%s", prefix, name);
+  } else {
+    snprintf(f->name, sizeof(f->name), "%s", name);
+  }
+  f->type = type;
+  f->defined = TRUE;
+  return f;
+}
+
+void
+add_uint(struct field_list *list, const char *prefix, const char *name,
+         uint64_t u) {
+  add_field(list, prefix, name, FIELD_UINT)->u = u;
+}
+
+void
+add_real(struct field_list *list, const char *prefix, const char *name,
+         double num, uint64_t den) {
+  struct field *f = add_field(list, prefix, name, FIELD_REAL);
+  f->defined = den > 0;
+  f->d = den > 0 ? num / den : 0.0;
+}
+
+// Add the configuration and counters of one level of the hierarchy
+//
+void
+add_level(struct field_list *list, const char *prefix, int level,
+          uint32_t sets, uint32_t assoc, uint32_t hitTime,
+          uint32_t block, uint32_t sector, uint64_t refs, uint64_t misses,
+          uint64_t penalties, uint64_t sectorMisses)
+{
+  const char *kinds[] = { "none", "victim", "miss" };
+
+  add_uint(list, prefix, "sets", sets);
+  add_uint(list, prefix, "assoc", assoc);
+  add_uint(list, prefix, "hit_time", hitTime);
+  add_uint(list, prefix, "blocksize", block);
+  add_uint(list, prefix, "sectorsize", sector);
+  add_field(list, prefix, "buffer", FIELD_STR)->s = kinds[bufferKind[level]];
+  add_uint(list, prefix, "buffer_entries", bufferEntries[level]);
+  add_uint(list, prefix, "buffer_hit_time", bufferHitTime[level]);
+
+  add_uint(list, prefix, "refs", refs);
+  add_uint(list, prefix, "misses", misses);
+  add_uint(list, prefix, "penalties", penalties);
+  add_real(list, prefix, "miss_rate", (double)misses, refs);
+  add_real(list, prefix, "avg_access_time",
+           (double)(penalties + refs * hitTime), refs);
+  add_uint(list, prefix, "sector_misses", sectorMisses);
+  add_uint(list, prefix, "buffer_probes", bufferProbes[level]);
+  add_uint(list, prefix, "buffer_hits", bufferHits[level]);
+  add_uint(list, prefix, "buffer_swaps", bufferSwaps[level]);
+}
+
+void
+gather_fields(struct field_list *list, uint64_t totalRefs,
+              uint64_t totalPenalties)
+{
+  list->n = 0;
+  add_level(list, "icache", ICACHE, icacheSets, icacheAssoc, icacheHitTime,
+            icacheBlocksize, icacheSectorsize, icacheRefs, icacheMisses,
+            icachePenalties, icacheSectorMisses);
+  add_level(list, "dcache", DCACHE, dcacheSets, dcacheAssoc, dcacheHitTime,
+            dcacheBlocksize, dcacheSectorsize, dcacheRefs, dcacheMisses,
+            dcachePenalties, dcacheSectorMisses);
+  add_level(list, "l2cache", L2CACHE, l2cacheSets, l2cacheAssoc,
+            l2cacheHitTime, l2cacheBlocksize, l2cacheSectorsize, l2cacheRefs,
+            l2cacheMisses, l2cachePenalties, l2cacheSectorMisses);
+  add_field(list, "l2cache", "inclusive", FIELD_BOOL)->u = inclusive;
+
+  add_uint(list, NULL, "blocksize", blocksize);
+  add_uint(list, NULL, "memspeed", memspeed);
+  add_uint(list, NULL, "address_size", addressSize);
+  add_uint(list, NULL, "total_refs", totalRefs);
+  add_uint(list, NULL, "total_penalties", totalPenalties);
+  add_uint(list, NULL, "memory_bytes", memoryBytes);
+  add_real(list, NULL, "avg_memory_access_time", (double)totalPenalties,
+           totalRefs);
+  add_uint(list, NULL, "l1_invalidations", l1Invalidations);
+  add_field(list, NULL, "replay_inexact", FIELD_BOOL)->u = replayInexact;
+}
+
+// Print out 's' as a JSON string
+//
+void
+print_json_string(FILE *out, const char *s)
+{
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// Print out 's' as a CSV value, quoting it if it needs to be
+//
+void
+print_csv_string(FILE *out, const char *s)
+{
+  if (!strpbrk(s, ",\"\n")) {
+    fputs(s, out);
+    return;
+  }
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"')
+      fputc('"', out);
+    fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+void
+print_value(FILE *out, struct field *f)
+{
+  switch (f->type) {
+    case FIELD_UINT:
+      fprintf(out, "%lu", f->u);
+      break;
+    case FIELD_REAL:
+      if (f->defined) {
+        fprintf(out, "%.6f", f->d);
+      } else if (outputFormat == FORMAT_JSON) {
+        fputs("null", out);
+      }
+      break;
+    case FIELD_BOOL:
+      fputs(f->u ? "true" : "false", out);
+      break;
+    case FIELD_STR:
+      if (outputFormat == FORMAT_JSON) {
+        print_json_string(out, f->s);
+      } else {
+        print_csv_string(out, f->s);
+      }
+      break;
+  }
+}
+
+//------------------------------------//
+//          Output Functions          //
+//------------------------------------//
+
+void
+printStats(FILE *out, uint64_t totalRefs, uint64_t totalPenalties)
+{
+  struct field_list list;
+  gather_fields(&list, totalRefs, totalPenalties);
+
+  if (outputFormat == FORMAT_JSON) {
+    fputc('{', out);
+    for (int i = 0; i < list.n; i++) {
+      fprintf(out, "%s\"%s\": ", i ? ", " : "", list.fields[i].name);
+      print_value(out, &list.fields[i]);
+    }
+    fputs("}\n", out);
+  } else {
+    for (int i = 0; i < list.n; i++)
+      fprintf(out, "%s%s", i ? "," : "", list.fields[i].name);
+    fputc('\n', out);
+    for (int i = 0; i < list.n; i++) {
+      if (i)
+        fputc(',', out);
+      print_value(out, &list.fields[i]);
+    }
+    fputc('\n', out);
+  }
+}
+
+void
+printStatsError(FILE *out, const char *message)
+{
+  if (outputFormat == FORMAT_JSON) {
+    fputs("{\"error\": ", out);
+    print_json_string(out, message);
+    fputs("}\n", out);
+  } else {
+    fputs("error\n", out);
+    print_csv_string(out, message);
+    fputc('\n', out);
+  }
+}
@@ -0,0 +1,42 @@
+//========================================================//
+//  stats.h                                               //
+//  Header file for the machine readable output of the    //
+//  Cache Simulator                                       //
+//                                                        //
+//  Writes the configuration and every counter of the     //
+//  simulator as JSON or CSV                              //
+//========================================================//
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Formats of the statistics
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV  2
+
+//------------------------------------//
+//        Output Configuration        //
+//------------------------------------//
+
+extern __thread uint32_t outputFormat;  // Format the statistics are printed in
+
+//------------------------------------//
+//     Output Function Prototypes     //
+//------------------------------------//
+
+// Print out the configuration and every counter of the simulator, along with
+// the totals of the trace, in the JSON or CSV 'outputFormat' to 'out'. JSON
+// is written as one object on a single line, CSV as a header line followed
+// by a line of values, with the same columns whatever the hierarchy
+//
+void printStats(FILE *out, uint64_t totalRefs, uint64_t totalPenalties);
+
+// Print out the error 'message' in the JSON or CSV 'outputFormat' to 'out'
+//
+void printStatsError(FILE *out, const char *message);
+
+#endif
@@ -0,0 +1,780 @@
+//========================================================//
+//  synth.c                                               //
+//  Source file for the workload profiles of the          //
+//  Cache Simulator                                       //
+//                                                        //
+//  A profile splits a trace into phases and keeps, for   //
+//  each phase, how the I and D references interleave     //
+//  and how each side reuses, strides through or jumps    //
+//  between blocks. The generator draws a synthetic       //
+//  trace with the same statistics straight from it       //
+//========================================================//
+
+#define _GNU_SOURCE
+#include "synth.h"
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//------------------------------------//
+//        Profile Configuration       //
+//------------------------------------//
+
+__thread uint64_t phaseLength;  // References summarized by each phase
+
+//------------------------------------//
+//       Profile Data Structures      //
+//------------------------------------//
+
+// Reuse is measured by the stack distance of a block: its depth in the LRU
+// stack of the blocks of its side, 1 for the block referenced last, which is
+// what decides whether an LRU cache still holds it. Distances 1 to 4 have
+// bins of their own, and every further power of two is split into 4 bins of
+// equal width, up to STACK_DEPTH
+//
+#define STACK_DEPTH (1 << 20)
+#define STACK_TOP   4
+#define REUSE_BINS  76
+#define NUM_STRIDES 8
+#define MAX_LAG     4
+#define LOW_BITS    8
+#define NUM_LOWS    (1 << LOW_BITS)
+#define NUM_DRAWS   (REUSE_BINS + NUM_STRIDES + 2)
+
+#define SIDE_I 0
+#define SIDE_D 1
+
+// The references of one side within a phase. Each one either reuses a block
+// within STACK_DEPTH of the top of the stack, moves by one of the most common
+// strides from one of the last MAX_LAG references, reuses a block deeper in
+// the stack, or touches a block for the first time, taken at random from
+// [lo, hi] with the low LOW_BITS bits of its number, which pick its set in
+// most caches, drawn from those of the new blocks of the phase.
+// Interleaved walks, like the rows and columns of a matrix, show up as
+// strides from a few references back, and each walk is kept within the
+// addresses it spans
+//
+struct side_model {
+  uint64_t refs;
+  uint64_t reuse[REUSE_BINS];
+  int64_t  stride[NUM_STRIDES];
+  uint64_t strideLo[NUM_STRIDES];
+  uint64_t strideHi[NUM_STRIDES];
+  uint64_t strideRefs[NUM_STRIDES];
+  uint64_t farRefs;
+  uint64_t newRefs;
+  uint64_t newLows[NUM_LOWS];  // New blocks by the low bits of their number
+  uint64_t lo, hi;             // Range of the blocks touched by the side
+};
+
+struct phase_model {
+  uint64_t refs;
+  uint64_t follows[2][2];      // References of each side after each side
+  struct side_model sides[2];
+};
+
+// The profile file is a header followed by one model per phase
+//
+#define PROFILE_MAGIC   "CSIMPROF"
+#define PROFILE_VERSION 2
+
+struct profile_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t blocksize;
+  uint32_t addressSize;
+  uint32_t reserved;
+  uint64_t phaseLength;
+  uint64_t totalRefs;
+  uint64_t numPhases;
+};
+
+// Time of the last reference to each block of one side, in an
+// open-addressing hash table keyed by the block number plus one
+//
+struct block_time {
+  uint64_t key;
+  uint64_t time;
+};
+
+struct block_table {
+  struct block_time *slots;
+  uint32_t size;               // Always a power of two
+  uint32_t used;
+};
+
+// The LRU stack of the blocks of one side. Every block marks the time of its
+// last reference in a Fenwick tree, so the depth of a block is a count of the
+// marks after its own, and the block at some depth is found by descending
+// the tree. Times are renumbered from 1 whenever they run out, which keeps
+// the tree to a few times the number of blocks. The times of the top
+// STACK_TOP blocks are also kept in order, since most references land there
+//
+struct lru_stack {
+  struct block_table blocks;
+  uint32_t *tree;              // Fenwick tree of the marks, from 1 to size
+  uint64_t *addrs;             // Last address referenced at each marked time
+  uint32_t top[STACK_TOP];     // Times of the top blocks, 0 for none
+  uint32_t size;               // Always a power of two
+  uint32_t now;                // Time of the last reference
+};
+
+// Frequent strides of one side, kept with the Misra-Gries summary so that
+// only NUM_STRIDES counters are needed. The summary carries over from one
+// phase to the next
+//
+struct stride_summary {
+  int64_t  stride[NUM_STRIDES];
+  uint64_t count[NUM_STRIDES];
+  uint64_t lo[NUM_STRIDES];    // Range of the addresses walked by the stride
+  uint64_t hi[NUM_STRIDES];
+};
+
+FILE *profileOut = NULL;
+uint64_t profilePhases;
+uint64_t profileRefs;
+struct phase_model profilePhase;
+struct lru_stack profileStacks[2];
+struct stride_summary sideStrides[2];
+uint64_t sideTime[2];          // References seen so far on each side
+uint64_t sideRecent[2][MAX_LAG];   // Last addresses of each side, by time
+int prevSide;
+int profileOffsetBits;
+
+// Generator state
+//
+struct side_gen {
+  struct lru_stack stack;
+  uint64_t prev;
+  int64_t  stride[NUM_STRIDES];
+  uint64_t strideLast[NUM_STRIDES]; // Last address of each walk, 0 for none
+  uint64_t strideSweep[NUM_STRIDES];
+  uint32_t drawShare[NUM_DRAWS]; // Alias table of the draws of the phase
+  uint8_t  drawAlias[NUM_DRAWS];
+  uint32_t lowShare[NUM_LOWS];   // Alias table of the low bits of new blocks
+  uint8_t  lowAlias[NUM_LOWS];
+};
+
+struct phase_model *synthPhases = NULL;
+uint64_t synthNumPhases;
+uint64_t synthPhase;
+uint64_t synthLeft;            // References left in the current phase
+uint32_t synthOffsetBits;
+struct side_gen *synthSides = NULL;
+int synthPrevSide;
+uint64_t rngState = 0x9E3779B97F4A7C15ull;
+
+//------------------------------------//
+//          Helper Functions          //
+//------------------------------------//
+
+int
+log2_ceil(uint64_t n) {
+  int bits = 0;
+  while (bits < 64 && ((uint64_t)1 << bits) < n)
+    bits++;
+  return bits;
+}
+
+// Return the bin of the stack distance 'd'
+//
+int
+reuse_bin(uint64_t d) {
+  uint64_t x = d - 1;
+  if (x < 4)
+    return x;
+  int e = log2_ceil(x + 1) - 1;
+  return 4 * (e - 1) + ((x >> (e - 2)) & 3);
+}
+
+// Find the nearest and farthest stack distances of bin 'n'
+//
+void
+bin_range(int n, uint64_t *nearest, uint64_t *farthest) {
+  if (n < 4) {
+    *nearest = *farthest = n + 1;
+    return;
+  }
+  int e = n / 4 + 1;
+  *nearest = ((uint64_t)(4 + n % 4) << (e - 2)) + 1;
+  *farthest = (uint64_t)(5 + n % 4) << (e - 2);
+}
+
+// xorshift64* generator
+//
+uint64_t
+next_random() {
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 0x2545F4914F6CDD1Dull;
+}
+
+// Draw a random number below 'n', scaling instead of dividing since this
+// runs a few times for every reference generated
+//
+uint64_t
+random_below(uint64_t n) {
+  return (uint64_t)(((unsigned __int128)next_random() * n) >> 64);
+}
+
+// Set up Walker's alias table of 'n' outcomes of the given 'weight'. Each
+// column of the table holds the share of one outcome topped up with another,
+// so that a draw takes a single lookup
+//
+void
+build_alias(const uint64_t *weight, int n, uint32_t *share, uint8_t *alias) {
+  double scaled[NUM_LOWS];
+  int small[NUM_LOWS], large[NUM_LOWS];
+  int numSmall = 0, numLarge = 0;
+  uint64_t sum = 0;
+
+  for (int i = 0; i < n; i++)
+    sum += weight[i];
+  for (int i = 0; i < n; i++) {
+    scaled[i] = sum ? (double)weight[i] * n / sum : 1.0;
+    if (scaled[i] < 1.0)
+      small[numSmall++] = i;
+    else
+      large[numLarge++] = i;
+  }
+  while (numSmall && numLarge) {
+    int s = small[--numSmall], l = large[numLarge - 1];
+    share[s] = scaled[s] * 4294967296.0;
+    alias[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      numLarge--;
+      small[numSmall++] = l;
+    }
+  }
+  // what is left is full, up to rounding
+  while (numLarge) {
+    int l = large[--numLarge];
+    share[l] = UINT32_MAX;
+    alias[l] = l;
+  }
+  while (numSmall) {
+    int s = small[--numSmall];
+    share[s] = UINT32_MAX;
+    alias[s] = s;
+  }
+}
+
+int
+draw_alias(const uint32_t *share, const uint8_t *alias, int n) {
+  uint64_t r = next_random();
+  int i = (r >> 32) * n >> 32;
+  return ((uint32_t)r < share[i]) ? i : alias[i];
+}
+
+struct block_time *
+find_block(struct block_table *table, uint64_t key) {
+  uint32_t mask = table->size - 1;
+  uint32_t slot = (key * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+  while (table->slots[slot].key && table->slots[slot].key != key)
+    slot = (slot + 1) & mask;
+  return &table->slots[slot];
+}
+
+// Double the size of a block table
+//
+void
+grow_blocks(struct block_table *table) {
+  struct block_time *old = table->slots;
+  uint32_t oldSize = table->size;
+
+  table->size *= 2;
+  table->slots = calloc(table->size, sizeof(struct block_time));
+  for (uint32_t i = 0; i < oldSize; i++)
+    if (old[i].key)
+      *find_block(table, old[i].key) = old[i];
+  free(old);
+}
+
+void
+init_stack(struct lru_stack *s) {
+  s->blocks.size = 1024;
+  s->blocks.used = 0;
+  s->blocks.slots = calloc(s->blocks.size, sizeof(struct block_time));
+  s->size = 1 << 14;
+  s->now = 0;
+  memset(s->top, 0, sizeof(s->top));
+  s->tree = calloc(s->size + 1, sizeof(uint32_t));
+  s->addrs = calloc(s->size + 1, sizeof(uint64_t));
+}
+
+void
+free_stack(struct lru_stack *s) {
+  free(s->blocks.slots);
+  free(s->tree);
+  free(s->addrs);
+}
+
+void
+mark_time(struct lru_stack *s, uint32_t t, int32_t v) {
+  for (; t <= s->size; t += t & -t)
+    s->tree[t] += v;
+}
+
+// Return the number of marks up to time 't'
+//
+uint32_t
+count_marks(struct lru_stack *s, uint32_t t) {
+  uint32_t n = 0;
+  for (; t; t -= t & -t)
+    n += s->tree[t];
+  return n;
+}
+
+int
+compare_times(const void *a, const void *b) {
+  const struct block_time *ba = *(struct block_time * const *)a;
+  const struct block_time *bb = *(struct block_time * const *)b;
+  return (ba->time > bb->time) - (ba->time < bb->time);
+}
+
+// Renumber the marks of a stack from 1 in the same order, growing the tree
+// so that at least half of it is left for the references to come
+//
+void
+compact_stack(struct lru_stack *s) {
+  uint32_t n = s->blocks.used;
+  struct block_time **marks = malloc(n * sizeof(struct block_time *));
+  uint32_t k = 0;
+  for (uint32_t i = 0; i < s->blocks.size; i++)
+    if (s->blocks.slots[i].key)
+      marks[k++] = &s->blocks.slots[i];
+  qsort(marks, n, sizeof(struct block_time *), compare_times);
+
+  uint64_t *addrs = s->addrs;
+  uint32_t oldSize = s->size;
+  while (s->size < 2 * n)
+    s->size *= 2;
+  s->addrs = calloc(s->size + 1, sizeof(uint64_t));
+  for (uint32_t i = 0; i < n; i++) {
+    s->addrs[i + 1] = addrs[marks[i]->time];
+    marks[i]->time = i + 1;
+  }
+  free(addrs);
+  free(marks);
+
+  // Every time up to n is marked, which the tree can be built from directly
+  if (s->size != oldSize) {
+    free(s->tree);
+    s->tree = malloc((s->size + 1) * sizeof(uint32_t));
+  }
+  for (uint32_t t = 1; t <= s->size; t++)
+    s->tree[t] = (t <= n) ? 1 : 0;
+  for (uint32_t t = 1; t <= s->size; t++) {
+    uint32_t up = t + (t & -t);
+    if (up <= s->size)
+      s->tree[up] += s->tree[t];
+  }
+  s->now = n;
+  for (uint32_t i = 0; i < STACK_TOP; i++)
+    s->top[i] = (i < n) ? n - i : 0;
+}
+
+// Move the block holding 'addr' to the top of the stack
+// Returns the stack distance it was at, or 0 if it is new
+//
+uint64_t
+touch_block(struct lru_stack *s, uint64_t addr, int offsetBits) {
+  if (s->now == s->size)
+    compact_stack(s);
+
+  uint64_t key = (addr >> offsetBits) + 1;
+  struct block_time *b = find_block(&s->blocks, key);
+  if (b->key && b->time == s->now) {
+    s->addrs[s->now] = addr;
+    return 1;
+  }
+
+  uint64_t depth = 0;
+  int i = STACK_TOP - 1;
+  if (b->key) {
+    for (i = 1; i < STACK_TOP - 1 && s->top[i] != b->time; i++)
+      ;
+    if (s->top[i] == b->time)
+      depth = i + 1;
+    else
+      depth = s->blocks.used - count_marks(s, b->time) + 1;
+    mark_time(s, b->time, -1);
+  } else {
+    if (2 * (s->blocks.used + 1) > s->blocks.size) {
+      grow_blocks(&s->blocks);
+      b = find_block(&s->blocks, key);
+    }
+    b->key = key;
+    s->blocks.used++;
+  }
+  memmove(&s->top[1], &s->top[0], i * sizeof(uint32_t));
+  b->time = ++s->now;
+  s->top[0] = b->time;
+  mark_time(s, b->time, 1);
+  s->addrs[b->time] = addr;
+  return depth;
+}
+
+// Return the last address referenced in the block at stack distance 'depth'
+//
+uint64_t
+block_at(struct lru_stack *s, uint64_t depth) {
+  if (depth <= STACK_TOP)
+    return s->addrs[s->top[depth - 1]];
+
+  uint32_t k = s->blocks.used - depth + 1;
+  uint32_t t = 0;
+  for (uint32_t step = s->size; step; step >>= 1) {
+    if (t + step <= s->size && s->tree[t + step] < k) {
+      t += step;
+      k -= s->tree[t];
+    }
+  }
+  return s->addrs[t + 1];
+}
+
+// Find the frequent stride that leads to 'addr' from one of the last
+// MAX_LAG references of a side, counting it in the summary
+// Returns its slot, or -1 if there is none
+//
+int
+match_stride(int side, uint64_t time, uint64_t addr) {
+  struct stride_summary *summary = &sideStrides[side];
+  for (int i = 0; i < NUM_STRIDES; i++) {
+    if (!summary->count[i])
+      continue;
+    for (uint64_t lag = 1; lag <= MAX_LAG && lag < time; lag++) {
+      uint64_t from = sideRecent[side][(time - lag) & (MAX_LAG - 1)];
+      if ((int64_t)(addr - from) == summary->stride[i]) {
+        summary->count[i]++;
+        if (addr < summary->lo[i])
+          summary->lo[i] = addr;
+        if (addr > summary->hi[i])
+          summary->hi[i] = addr;
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+// Offer the stride from 'from' to 'addr' to the summary of a side
+//
+void
+add_stride(int side, uint64_t from, uint64_t addr) {
+  struct stride_summary *summary = &sideStrides[side];
+  for (int i = 0; i < NUM_STRIDES; i++) {
+    if (!summary->count[i]) {
+      summary->stride[i] = (int64_t)(addr - from);
+      summary->count[i] = 1;
+      summary->lo[i] = from < addr ? from : addr;
+      summary->hi[i] = from < addr ? addr : from;
+      return;
+    }
+  }
+  for (int i = 0; i < NUM_STRIDES; i++)
+    summary->count[i]--;
+}
+
+void
+reset_phase() {
+  memset(&profilePhase, 0, sizeof(profilePhase));
+  for (int side = SIDE_I; side <= SIDE_D; side++)
+    profilePhase.sides[side].lo = UINT64_MAX;
+}
+
+// Finish the model of the current phase and write it out
+//
+void
+write_phase() {
+  for (int side = SIDE_I; side <= SIDE_D; side++) {
+    struct side_model *m = &profilePhase.sides[side];
+    for (int i = 0; i < NUM_STRIDES; i++) {
+      m->stride[i] = sideStrides[side].stride[i];
+      m->strideLo[i] = sideStrides[side].lo[i];
+      m->strideHi[i] = sideStrides[side].hi[i];
+    }
+  }
+  if (fwrite(&profilePhase, sizeof(profilePhase), 1, profileOut) == 1)
+    profilePhases++;
+  reset_phase();
+}
+
+// Set up the draws of a side for a phase: the reuse bins, then the strides,
+// then the far reuses and the new blocks, and the low bits of new blocks
+//
+void
+prepare_side(struct side_gen *gen, struct side_model *m) {
+  for (int i = 0; i < NUM_STRIDES; i++) {
+    if (gen->stride[i] != m->stride[i]) {
+      gen->stride[i] = m->stride[i];
+      gen->strideLast[i] = 0;
+      gen->strideSweep[i] = 0;
+    }
+  }
+
+  uint64_t weight[NUM_DRAWS];
+  int n = 0;
+  for (int b = 0; b < REUSE_BINS; b++)
+    weight[n++] = m->reuse[b];
+  for (int i = 0; i < NUM_STRIDES; i++)
+    weight[n++] = m->strideRefs[i];
+  weight[n++] = m->farRefs;
+  weight[n++] = m->newRefs;
+  build_alias(weight, NUM_DRAWS, gen->drawShare, gen->drawAlias);
+  build_alias(m->newLows, NUM_LOWS, gen->lowShare, gen->lowAlias);
+}
+
+// Draw the next address of a side
+//
+uint64_t
+draw_address(struct side_gen *gen, struct side_model *m) {
+  uint64_t blocks = gen->stack.blocks.used;
+  int n = draw_alias(gen->drawShare, gen->drawAlias, NUM_DRAWS);
+
+  uint64_t addr;
+  if (n < REUSE_BINS && blocks) {
+    // The block at a stack distance within the bin, or the deepest one if
+    // the stack isn't that deep yet
+    uint64_t nearest, farthest;
+    bin_range(n, &nearest, &farthest);
+    if (farthest > blocks)
+      farthest = blocks;
+    if (nearest > farthest)
+      nearest = farthest;
+    uint64_t depth = nearest;
+    if (farthest > nearest)
+      depth += random_below(farthest - nearest + 1);
+    addr = block_at(&gen->stack, depth);
+  } else if (n >= REUSE_BINS && n < REUSE_BINS + NUM_STRIDES && blocks) {
+    // Carry on the walk of the stride. A walk leaving the addresses the
+    // stride spans sweeps them again from one block further along, the way
+    // a loop nest moves on to the next columns of an array
+    int i = n - REUSE_BINS;
+    int64_t stride = gen->stride[i];
+    uint64_t step = stride < 0 ? -(uint64_t)stride : (uint64_t)stride;
+    addr = (gen->strideLast[i] ? gen->strideLast[i] : gen->prev) + stride;
+    if (addr < m->strideLo[i] || addr > m->strideHi[i]) {
+      gen->strideSweep[i] += (uint64_t)1 << synthOffsetBits;
+      uint64_t shift = step ? gen->strideSweep[i] % step : 0;
+      addr = (stride < 0) ? m->strideHi[i] - shift : m->strideLo[i] + shift;
+    }
+    gen->strideLast[i] = addr;
+  } else if (n == REUSE_BINS + NUM_STRIDES && blocks) {
+    // A block deeper than the stack distances kept, or any block if there
+    // are none that deep
+    uint64_t depth = (blocks > STACK_DEPTH)
+                   ? STACK_DEPTH + 1 + random_below(blocks - STACK_DEPTH)
+                   : 1 + random_below(blocks);
+    addr = block_at(&gen->stack, depth);
+  } else {
+    uint64_t block = m->lo + random_below(m->hi - m->lo + 1);
+    uint64_t low = draw_alias(gen->lowShare, gen->lowAlias, NUM_LOWS);
+    block = (block & ~(uint64_t)(NUM_LOWS - 1)) | low;
+    if (block < m->lo && block + NUM_LOWS <= m->hi)
+      block += NUM_LOWS;
+    else if (block > m->hi && block >= m->lo + NUM_LOWS)
+      block -= NUM_LOWS;
+    addr = block << synthOffsetBits;
+  }
+
+  touch_block(&gen->stack, addr, synthOffsetBits);
+  gen->prev = addr;
+  return addr;
+}
+
+//------------------------------------//
+//         Profile Functions          //
+//------------------------------------//
+
+int
+profile_open(const char *file)
+{
+  profileOut = fopen(file, "wb");
+  if (!profileOut) {
+    fprintf(stderr,"Unable to open profile '%s' for writing\n", file);
+    return 0;
+  }
+
+  profileOffsetBits = log2_ceil(blocksize);
+  for (int side = SIDE_I; side <= SIDE_D; side++) {
+    init_stack(&profileStacks[side]);
+    sideTime[side] = 0;
+    memset(sideRecent[side], 0, sizeof(sideRecent[side]));
+    memset(&sideStrides[side], 0, sizeof(sideStrides[side]));
+  }
+  prevSide = SIDE_I;
+  profilePhases = 0;
+  profileRefs = 0;
+  reset_phase();
+
+  // Leave room for the header, written once the totals are known
+  struct profile_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  return fwrite(&hdr, sizeof(hdr), 1, profileOut) == 1;
+}
+
+void
+profile_access(uint64_t addr, char i_or_d)
+{
+  int side = (i_or_d == 'D') ? SIDE_D : SIDE_I;
+  struct side_model *m = &profilePhase.sides[side];
+  uint64_t block = addr >> profileOffsetBits;
+
+  profileRefs++;
+  profilePhase.refs++;
+  profilePhase.follows[prevSide][side]++;
+  prevSide = side;
+  m->refs++;
+  if (block < m->lo)
+    m->lo = block;
+  if (block > m->hi)
+    m->hi = block;
+
+  uint64_t time = ++sideTime[side];
+  uint64_t depth = touch_block(&profileStacks[side], addr, profileOffsetBits);
+  if (depth && depth <= STACK_DEPTH) {
+    m->reuse[reuse_bin(depth)]++;
+  } else {
+    int i = match_stride(side, time, addr);
+    if (i >= 0) {
+      m->strideRefs[i]++;
+    } else {
+      if (depth) {
+        m->farRefs++;
+      } else {
+        m->newRefs++;
+        m->newLows[block & (NUM_LOWS - 1)]++;
+      }
+      // Try the strides from each of the last references in turn
+      uint64_t lag = 1 + time % MAX_LAG;
+      if (lag < time)
+        add_stride(side, sideRecent[side][(time - lag) & (MAX_LAG - 1)], addr);
+    }
+  }
+  sideRecent[side][time & (MAX_LAG - 1)] = addr;
+
+  if (profilePhase.refs == phaseLength)
+    write_phase();
+}
+
+int64_t
+profile_close()
+{
+  if (profilePhase.refs)
+    write_phase();
+
+  struct profile_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+  hdr.version     = PROFILE_VERSION;
+  hdr.blocksize   = blocksize;
+  hdr.addressSize = addressSize;
+  hdr.phaseLength = phaseLength;
+  hdr.totalRefs   = profileRefs;
+  hdr.numPhases   = profilePhases;
+
+  int ok = !ferror(profileOut) && fseek(profileOut, 0, SEEK_SET) == 0 &&
+           fwrite(&hdr, sizeof(hdr), 1, profileOut) == 1;
+  ok = (fclose(profileOut) == 0) && ok;
+  profileOut = NULL;
+
+  for (int side = SIDE_I; side <= SIDE_D; side++)
+    free_stack(&profileStacks[side]);
+
+  return ok ? (int64_t)profilePhases : -1;
+}
+
+//------------------------------------//
+//        Generator Functions         //
+//------------------------------------//
+
+int
+synth_open(const char *file)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr,"Unable to open profile '%s'\n", file);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct profile_header)) {
+    fprintf(stderr,"Profile '%s' is truncated\n", file);
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"Unable to map profile '%s'\n", file);
+    return 0;
+  }
+
+  struct profile_header *hdr = map;
+  if (memcmp(hdr->magic, PROFILE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != PROFILE_VERSION ||
+      st.st_size != sizeof(*hdr) + hdr->numPhases * sizeof(struct phase_model)) {
+    fprintf(stderr,"'%s' is not a valid profile\n", file);
+    munmap(map, st.st_size);
+    return 0;
+  }
+  if (hdr->addressSize > addressSize) {
+    fprintf(stderr,"Profile '%s' holds %u-bit addresses, use --addrsize\n",
+            file, hdr->addressSize);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  synthPhases = (struct phase_model *)(hdr + 1);
+  synthNumPhases = hdr->numPhases;
+  synthOffsetBits = log2_ceil(hdr->blocksize);
+  synthSides = calloc(2, sizeof(struct side_gen));
+  for (int side = SIDE_I; side <= SIDE_D; side++)
+    init_stack(&synthSides[side].stack);
+  synthPhase = 0;
+  synthLeft = synthNumPhases ? synthPhases[0].refs : 0;
+  synthPrevSide = SIDE_I;
+  if (synthNumPhases) {
+    for (int side = SIDE_I; side <= SIDE_D; side++)
+      prepare_side(&synthSides[side], &synthPhases[0].sides[side]);
+  }
+
+  return 1;
+}
+
+int
+synth_next(uint64_t *addr, char *i_or_d)
+{
+  while (!synthLeft) {
+    if (++synthPhase >= synthNumPhases)
+      return 0;
+    synthLeft = synthPhases[synthPhase].refs;
+    for (int side = SIDE_I; side <= SIDE_D; side++)
+      prepare_side(&synthSides[side], &synthPhases[synthPhase].sides[side]);
+  }
+  synthLeft--;
+
+  // Pick the side following the previous one, or by the share of each side
+  // if the phase never follows that side
+  struct phase_model *p = &synthPhases[synthPhase];
+  uint64_t toI = p->follows[synthPrevSide][SIDE_I];
+  uint64_t toD = p->follows[synthPrevSide][SIDE_D];
+  if (!toI && !toD) {
+    toI = p->sides[SIDE_I].refs;
+    toD = p->sides[SIDE_D].refs;
+  }
+  int side = (random_below(toI + toD) < toI) ? SIDE_I : SIDE_D;
+  synthPrevSide = side;
+
+  *addr = draw_address(&synthSides[side], &p->sides[side]);
+  *i_or_d = (side == SIDE_D) ? 'D' : 'I';
+  return 1;
+}
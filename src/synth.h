@@ -0,0 +1,50 @@
+//========================================================//
+//  synth.h                                               //
+//  Header file for the workload profiles of the          //
+//  Cache Simulator                                       //
+//                                                        //
+//  Summarizes a trace as a small statistical model and   //
+//  streams a synthetic trace back out of one             //
+//========================================================//
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+
+//------------------------------------//
+//        Profile Configuration       //
+//------------------------------------//
+
+extern __thread uint64_t phaseLength;  // References summarized by each phase
+
+//------------------------------------//
+//    Profile Function Prototypes     //
+//------------------------------------//
+
+// Start writing a workload profile of the trace to 'file'
+// Returns True if Successful
+//
+int profile_open(const char *file);
+
+// Add a memory access to the 'I' or 'D' side at address 'addr' to the profile
+//
+void profile_access(uint64_t addr, char i_or_d);
+
+// Finish the profile
+// Returns the number of phases written, or -1 if the profile couldn't be
+// written
+//
+int64_t profile_close();
+
+// Start generating a synthetic trace from the profile in 'file'
+// Returns True if Successful
+//
+int synth_open(const char *file);
+
+// Generate the next memory access of the synthetic trace
+// Returns True if Successful, False once the profile is exhausted
+//
+int synth_next(uint64_t *addr, char *i_or_d);
+
+#endif